@@ -0,0 +1,60 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <vector>
+
+// Measures actor message throughput. Tokens are passed around a ring of
+// actors, each actor forwarding a token to the next one until it has made
+// the given number of hops
+
+void run(int actors, int tokens, int hops, size_t batch) {
+    std::vector<gthread::actor<int>> ring;
+    ring.reserve(actors);
+
+    std::atomic<int> remaining = tokens;
+    gthread::promise<void> done;
+    auto finished = done.get_future();
+
+    for (int i = 0; i < actors; i++) {
+        auto next = (i + 1) % actors;
+
+        ring.emplace_back(
+            [&, next](int& hops_left) {
+                if (hops_left > 0)
+                    ring[next].send(hops_left - 1);
+
+                else if (remaining.fetch_sub(1) == 1)
+                    done.set();
+            },
+            gthread::default_executor(), batch);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < tokens; i++)
+        ring[i * actors / tokens].send(hops);
+
+    finished.wait();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    auto messages = static_cast<long>(tokens) * (hops + 1);
+
+    std::cout << actors << " actors, " << tokens << " tokens, batch " << batch
+              << ": " << messages << " messages, " << ns.count() / messages
+              << " ns/message" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int actors = argc > 1 ? atoi(argv[1]) : 1000;
+    int tokens = argc > 2 ? atoi(argv[2]) : 100;
+    int hops = argc > 3 ? atoi(argv[3]) : 10000;
+
+    run(actors, 1, hops, gthread::default_actor_batch);
+    run(actors, tokens, hops, 1);
+    run(actors, tokens, hops, gthread::default_actor_batch);
+}
\ No newline at end of file
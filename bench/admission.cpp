@@ -0,0 +1,76 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <optional>
+#include <vector>
+
+// Measures a burst of spawns with and without admission limits. Each task
+// yields a few times so that many of them are alive at once. Reports how
+// many gthreads and stack bytes were live at the peak
+
+std::atomic<size_t> peak_live = 0;
+std::atomic<size_t> peak_stack_bytes = 0;
+
+void update_peak(std::atomic<size_t>& peak, size_t value) {
+    auto current = peak.load();
+    while (value > current && !peak.compare_exchange_weak(current, value))
+        ;
+}
+
+void task() {
+    auto metrics = gthread::metrics();
+    update_peak(peak_live, metrics.live);
+    update_peak(peak_stack_bytes, metrics.stack_bytes);
+
+    for (int i = 0; i < 4; i++) gthread::yield();
+}
+
+template <typename Spawn>
+void run(const char* name, int tasks, Spawn&& spawn) {
+    peak_live = 0;
+    peak_stack_bytes = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<gthread::future<void>> futures;
+    futures.reserve(tasks);
+
+    for (int i = 0; i < tasks; i++) {
+        auto f = spawn();
+        if (f) futures.push_back(std::move(*f));
+    }
+
+    for (auto& f : futures) f.get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::cout << name << ": ran " << futures.size() << " of " << tasks
+              << " in " << ms.count() << " ms, peak " << peak_live
+              << " live gthreads, " << (peak_stack_bytes >> 20)
+              << " MiB of stacks, " << gthread::metrics().rejected
+              << " rejected in total" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 10000;
+    size_t max_live = argc > 2 ? atoi(argv[2]) : 256;
+
+    run("unlimited", tasks, [] {
+        return std::optional{gthread::execute(task)};
+    });
+
+    gthread::admission_limits limits;
+    limits.max_live = max_live;
+    gthread::set_limits(limits);
+
+    run("wait_for_capacity", tasks, [] {
+        return std::optional{
+            gthread::execute(gthread::wait_for_capacity, task)};
+    });
+
+    run("try_execute", tasks, [] { return gthread::try_execute(task); });
+}
\ No newline at end of file
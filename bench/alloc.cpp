@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Measures allocation heavy tasks, where every task builds a map and a list
+// of small nodes and then throws them away, once with each allocator
+
+template <template <typename> typename Allocator>
+long build(int nodes) {
+    using pair = std::pair<const int, long>;
+
+    std::map<int, long, std::less<int>, Allocator<pair>> map;
+    std::list<long, Allocator<long>> list;
+
+    for (int i = 0; i < nodes; i++) {
+        map.emplace(i * 7919 % nodes, i);
+        list.push_back(i);
+    }
+
+    long sum = 0;
+    for (auto& [key, value] : map) sum += key ^ value;
+    for (auto value : list) sum += value;
+
+    return sum;
+}
+
+template <template <typename> typename Allocator>
+void run(const char* name, int tasks, int nodes) {
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<gthread::future<long>> futures;
+    futures.reserve(tasks);
+
+    for (int i = 0; i < tasks; i++)
+        futures.push_back(gthread::execute(build<Allocator>, nodes));
+
+    long sum = 0;
+    for (auto& f : futures) sum += f.get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::cout << name << ": " << tasks << " tasks of " << nodes
+              << " nodes = " << sum << " in " << ms.count() << " ms"
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 1000;
+    int nodes = argc > 2 ? atoi(argv[2]) : 1000;
+
+    run<std::allocator>("std::allocator", tasks, nodes);
+    run<gthread::allocator>("gthread::allocator", tasks, nodes);
+    run<gthread::arena_allocator>("gthread::arena_allocator", tasks, nodes);
+}
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <list>
+#include <vector>
+
+// Measures passing large containers into gthreads. Arguments passed as
+// lvalues are copied into the task once, arguments passed with std::move
+// are moved into it and on into the function. Also runs a merge sort that
+// hands each half of a std::list to a child gthread
+
+std::atomic<size_t> copies = 0;
+
+// A vector that counts how often it is copied
+struct counted : std::vector<int> {
+    using std::vector<int>::vector;
+
+    counted(const counted& other) : std::vector<int>(other) { copies++; }
+    counted(counted&&) = default;
+};
+
+size_t sum(counted values) {
+    size_t total = 0;
+    for (auto v : values) total += v;
+    return total;
+}
+
+template <typename Spawn>
+void run(const char* name, int tasks, size_t size, Spawn&& spawn) {
+    copies = 0;
+
+    std::vector<counted> inputs(tasks, counted(size, 1));
+    copies = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<gthread::future<size_t>> futures;
+    futures.reserve(tasks);
+
+    for (auto& input : inputs) futures.push_back(spawn(input));
+
+    size_t total = 0;
+    for (auto& f : futures) total += f.get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::cout << name << ": " << tasks << " tasks summed " << total << " in "
+              << ms.count() << " ms with " << copies << " copies"
+              << std::endl;
+}
+
+std::list<int> merge_sort(std::list<int> values) {
+    if (values.size() < 2) return values;
+
+    std::list<int> upper;
+    auto middle = std::next(values.begin(), values.size() / 2);
+    upper.splice(upper.begin(), values, middle, values.end());
+
+    auto lhs = gthread::execute(merge_sort, std::move(values));
+    auto rhs = gthread::execute(merge_sort, std::move(upper));
+
+    auto sorted = std::move(lhs).get();
+    auto other = std::move(rhs).get();
+    sorted.merge(other);
+
+    return sorted;
+}
+
+int main(int argc, char** argv) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t size = argc > 2 ? atoi(argv[2]) : 100000;
+    int sort_size = argc > 3 ? atoi(argv[3]) : 100000;
+
+    run("copied", tasks, size,
+        [](counted& input) { return gthread::execute(sum, input); });
+
+    run("moved", tasks, size, [](counted& input) {
+        return gthread::execute(sum, std::move(input));
+    });
+
+    std::list<int> values;
+    for (int i = 0; i < sort_size; i++) values.push_back(rand());
+
+    auto start = std::chrono::steady_clock::now();
+
+    auto sorted = gthread::execute(merge_sort, std::move(values)).get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::cout << "merge sort: " << sorted.size() << " values in "
+              << ms.count() << " ms" << std::endl;
+}
\ No newline at end of file
@@ -0,0 +1,36 @@
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+
+// Measures recursive fork-join throughput, where every level spawns two
+// children and waits on both of them, once with each spawn hint
+
+long fib(gthread::spawn_hint hint, int n) {
+    if (n < 2) return n;
+
+    auto lhs = gthread::execute(hint, fib, hint, n - 1);
+    auto rhs = gthread::execute(hint, fib, hint, n - 2);
+
+    return lhs.get() + rhs.get();
+}
+
+void run(const char* name, gthread::spawn_hint hint, int n) {
+    auto start = std::chrono::steady_clock::now();
+
+    auto value = gthread::execute(fib, hint, n).get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::cout << name << ": fib(" << n << ") = " << value << " in "
+              << ms.count() << " ms" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 20;
+
+    run("any_worker", gthread::any_worker, n);
+    run("same_worker", gthread::same_worker, n);
+}
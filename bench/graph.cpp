@@ -0,0 +1,82 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <vector>
+
+// Measures running a layered DAG where every node depends on two nodes of the
+// layer before it, once as a gthread::graph and once by creating a gthread
+// per node and waiting on each layer before starting the next
+
+std::atomic<long> counter = 0;
+
+void work() { counter.fetch_add(1, std::memory_order_relaxed); }
+
+template <typename Func>
+long time_ms(Func&& func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration_cast<std::chrono::milliseconds>(end - start)
+        .count();
+}
+
+int main(int argc, char** argv) {
+    int layers = argc > 1 ? atoi(argv[1]) : 50;
+    int width = argc > 2 ? atoi(argv[2]) : 1000;
+    int runs = argc > 3 ? atoi(argv[3]) : 5;
+
+    gthread::graph g;
+
+    auto build_ms = time_ms([&] {
+        std::vector<gthread::graph::node> previous, current;
+
+        for (int layer = 0; layer < layers; layer++) {
+            current.clear();
+
+            for (int i = 0; i < width; i++) {
+                auto node = g.emplace(work);
+
+                if (layer > 0) {
+                    node.succeed(previous[i]);
+                    node.succeed(previous[(i + 1) % width]);
+                }
+
+                current.push_back(node);
+            }
+
+            previous.swap(current);
+        }
+    });
+
+    std::cout << "graph: built " << g.size() << " nodes in " << build_ms
+              << " ms" << std::endl;
+
+    for (int run = 0; run < runs; run++) {
+        counter = 0;
+        auto ms = time_ms([&] { g.run().get(); });
+
+        std::cout << "graph: run " << run << " ran " << counter << " nodes in "
+                  << ms << " ms" << std::endl;
+    }
+
+    counter = 0;
+    auto ms = time_ms([&] {
+        std::vector<gthread::future<void>> futures;
+        futures.reserve(width);
+
+        for (int layer = 0; layer < layers; layer++) {
+            futures.clear();
+
+            for (int i = 0; i < width; i++)
+                futures.push_back(gthread::execute(work));
+
+            for (auto& f : futures) f.get();
+        }
+    });
+
+    std::cout << "execute per layer: ran " << counter << " nodes in " << ms
+              << " ms" << std::endl;
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+
+// Measures handoff latency between a parent gthread that spawns a child and
+// immediately waits on it, once with each spawn hint
+
+int pong(int value) { return value + 1; }
+
+int ping(gthread::spawn_hint hint, int rounds) {
+    int value = 0;
+
+    for (int i = 0; i < rounds; i++)
+        value = gthread::execute(hint, pong, value).get();
+
+    return value;
+}
+
+void run(const char* name, gthread::spawn_hint hint, int rounds) {
+    auto start = std::chrono::steady_clock::now();
+
+    auto value = gthread::execute(ping, hint, rounds).get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    std::cout << name << ": " << rounds << " round trips, "
+              << ns.count() / rounds << " ns/round trip";
+
+    if (value != rounds) std::cout << " (wrong result " << value << ")";
+
+    std::cout << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100000;
+
+    run("any_worker", gthread::any_worker, rounds);
+    run("same_worker", gthread::same_worker, rounds);
+}
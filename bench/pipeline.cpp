@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <gthread.hpp>
+#include <iostream>
+#include <string>
+#include <thread>
+
+// Measures a read, parse, transform and write pipeline over a synthetic file
+// of comma separated lines, once with a single token in flight and once with
+// several. The size defaults to 10 GiB, pass a smaller one in MiB to try it
+// out. By default the file is created in the temporary directory and removed
+// afterwards. A path can be passed after the size to keep the file instead,
+// it is then only created if it doesn't exist or has the wrong size.
+//
+// First checks that tokens behind a slow serial input overlap in a parallel
+// stage, and fails if they don't while there are several kernel threads
+
+constexpr size_t chunk_size = 1024 * 1024;
+
+struct token {
+    std::string data;
+    size_t lines = 0;
+    size_t fields = 0;
+    uint64_t checksum = 0;
+};
+
+void create_file(const char* path, uint64_t size) {
+    auto file = std::fopen(path, "rb");
+
+    if (file) {
+        std::fseek(file, 0, SEEK_END);
+        auto existing = static_cast<uint64_t>(std::ftell(file));
+        std::fclose(file);
+
+        if (existing == size) return;
+    }
+
+    std::cout << "creating " << size / (1024 * 1024) << " MiB file " << path
+              << std::endl;
+
+    file = std::fopen(path, "wb");
+
+    if (!file) {
+        std::perror(path);
+        std::exit(1);
+    }
+
+    std::string buffer;
+    uint64_t written = 0;
+    uint64_t id = 0;
+
+    while (written < size) {
+        buffer.clear();
+
+        while (buffer.size() < chunk_size) {
+            buffer += std::to_string(id) + ",user" + std::to_string(id % 9973) +
+                      "," + std::to_string(id * 2654435761u % 1000000) +
+                      ",some payload text\n";
+            id++;
+        }
+
+        auto count = std::min<uint64_t>(buffer.size(), size - written);
+        std::fwrite(buffer.data(), 1, count, file);
+        written += count;
+    }
+
+    std::fclose(file);
+}
+
+void spin_for(std::chrono::microseconds duration) {
+    auto end = std::chrono::steady_clock::now() + duration;
+    while (std::chrono::steady_clock::now() < end) continue;
+}
+
+// Runs items through a 2 ms serial input and a 20 ms parallel stage. Returns
+// true if tokens were in the parallel stage at the same time and that made
+// the run clearly faster than passing the items through one at a time
+bool overlap(size_t max_tokens) {
+    constexpr int items = 40;
+    constexpr auto one_at_a_time = std::chrono::milliseconds(items * 22);
+
+    int read = 0;
+    std::atomic<size_t> inside = 0;
+    std::atomic<size_t> most = 0;
+
+    gthread::pipeline<int> p([&](int& t) {
+        if (read == items) return false;
+
+        t = read++;
+        spin_for(std::chrono::milliseconds(2));
+        return true;
+    });
+
+    p.stage(gthread::parallel, [&](int&) {
+        auto count = inside.fetch_add(1) + 1;
+        auto seen = most.load();
+
+        while (seen < count && !most.compare_exchange_weak(seen, count))
+            continue;
+
+        spin_for(std::chrono::milliseconds(20));
+        inside.fetch_sub(1);
+    });
+
+    auto start = std::chrono::steady_clock::now();
+
+    p.run(max_tokens).get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::cout << "overlap, " << max_tokens << " tokens: " << items
+              << " items in " << ms.count() << " ms, at most " << most
+              << " in the parallel stage" << std::endl;
+
+    return most > 1 && ms < one_at_a_time * 3 / 4;
+}
+
+void run(const char* path, size_t max_tokens) {
+    auto file = std::fopen(path, "rb");
+
+    // Only touched by the input, which runs one token at a time
+    std::string carry;
+    std::string buffer(chunk_size, '\0');
+
+    uint64_t bytes = 0;
+    uint64_t lines = 0;
+    uint64_t fields = 0;
+    uint64_t checksum = 0;
+
+    gthread::pipeline<token> p([&](token& t) {
+        auto count = gthread::blocking([&] {
+                         return std::fread(buffer.data(), 1, buffer.size(),
+                                           file);
+                     }).get();
+
+        if (count == 0 && carry.empty()) return false;
+
+        // Hand the partial line at the end over to the next token
+        auto end = count;
+        while (end > 0 && buffer[end - 1] != '\n') end--;
+
+        if (count == 0 || (end == 0 && count < buffer.size())) end = count;
+
+        t.data.assign(carry);
+        t.data.append(buffer.data(), end);
+        carry.assign(buffer.data() + end, count - end);
+
+        return true;
+    });
+
+    p.stage(gthread::parallel,
+            [](token& t) {
+                t.lines = 0;
+                t.fields = 0;
+
+                for (auto c : t.data) {
+                    t.lines += c == '\n';
+                    t.fields += c == ',' || c == '\n';
+                }
+            })
+        .stage(gthread::parallel,
+               [](token& t) {
+                   // FNV-1a of every line, summed
+                   uint64_t sum = 0;
+                   uint64_t hash = 14695981039346656037ull;
+
+                   for (auto c : t.data) {
+                       if (c == '\n') {
+                           sum += hash;
+                           hash = 14695981039346656037ull;
+                       } else {
+                           hash = (hash ^ static_cast<uint8_t>(c)) *
+                                  1099511628211ull;
+                       }
+                   }
+
+                   t.checksum = sum;
+               })
+        .stage(gthread::serial_in_order, [&](token& t) {
+            // Depends on the order the tokens arrive in
+            checksum = checksum * 31 + t.checksum;
+            bytes += t.data.size();
+            lines += t.lines;
+            fields += t.fields;
+        });
+
+    auto start = std::chrono::steady_clock::now();
+
+    p.run(max_tokens).get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+    std::fclose(file);
+
+    std::cout << max_tokens << " tokens: " << lines << " lines, " << fields
+              << " fields, checksum " << checksum << " in " << ms.count()
+              << " ms, "
+              << bytes / (1024.0 * 1024.0) / (ms.count() / 1000.0 + 1e-9)
+              << " MiB/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    uint64_t size_mib = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 10240;
+
+    auto threads = std::max(1u, std::thread::hardware_concurrency());
+
+    if (!overlap(std::min(threads, 4u)) && threads > 1) {
+        std::cout << "tokens did not overlap in the parallel stage"
+                  << std::endl;
+        return 1;
+    }
+
+    auto keep = argc > 2;
+    auto path = keep ? std::filesystem::path(argv[2])
+                     : std::filesystem::temp_directory_path() /
+                           "gthread_pipeline_bench.txt";
+
+    create_file(path.c_str(), size_mib * 1024 * 1024);
+
+    run(path.c_str(), 1);
+    run(path.c_str(), threads * 2);
+
+    if (!keep) std::filesystem::remove(path);
+}
\ No newline at end of file
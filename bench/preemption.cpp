@@ -0,0 +1,77 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+// Measures how long short gthreads wait to start while CPU hogs that never
+// yield are running, with and without preemption
+
+using Clock = std::chrono::steady_clock;
+
+void hog(std::chrono::milliseconds duration) {
+    auto end = Clock::now() + duration;
+
+    volatile uint64_t spins = 0;
+    while (Clock::now() < end) spins = spins + 1;
+}
+
+long probe(Clock::time_point spawned) {
+    auto latency = Clock::now() - spawned;
+    return std::chrono::duration_cast<std::chrono::microseconds>(latency)
+        .count();
+}
+
+void run(const char* name, int hogs, int probes) {
+    std::vector<gthread::future<void>> hog_futures;
+    for (int i = 0; i < hogs; i++)
+        hog_futures.emplace_back(
+            gthread::execute(hog, std::chrono::milliseconds(500)));
+
+    // Probes are spawned from a separate kernel thread so that they keep
+    // arriving while the hogs are running
+    std::vector<gthread::future<long>> probe_futures(probes);
+    std::atomic<bool> spawned = false;
+
+    std::thread spawner([&] {
+        for (auto& f : probe_futures) {
+            f = gthread::execute(probe, Clock::now());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        spawned = true;
+    });
+
+    while (!spawned) gthread::yield();
+
+    spawner.join();
+
+    std::vector<long> latencies;
+    for (auto& f : probe_futures) latencies.push_back(f.get());
+
+    for (auto& f : hog_futures) f.get();
+
+    std::sort(latencies.begin(), latencies.end());
+
+    auto percentile = [&](double p) {
+        return latencies[static_cast<size_t>(p * (latencies.size() - 1))];
+    };
+
+    std::cout << name << ": p50 " << percentile(0.5) << " us, p99 "
+              << percentile(0.99) << " us, max " << latencies.back() << " us"
+              << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int hogs = argc > 1 ? atoi(argv[1]) : 1;
+    int probes = argc > 2 ? atoi(argv[2]) : 200;
+
+    run("cooperative", hogs, probes);
+
+    gthread::enable_preemption(std::chrono::milliseconds(2));
+    run("preemptive (2 ms slice)", hogs, probes);
+    gthread::disable_preemption();
+}
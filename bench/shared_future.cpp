@@ -0,0 +1,127 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <vector>
+
+// Measures how long it takes to wake many gthreads waiting on the same
+// value. The broadcast case has every gthread wait on a copy of one
+// shared_future. The per-waiter case gives each gthread its own promise,
+// which are set one after the other. Also counts how often a slow lookup
+// runs when every gthread asks for the same key through single_flight
+
+using clock_type = std::chrono::steady_clock;
+
+std::atomic<size_t> woken = 0;
+
+long long microseconds(clock_type::time_point from, clock_type::time_point to) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(to - from)
+        .count();
+}
+
+// Reports how long setting the value took, which is when every waiter is
+// queued again, and how long until all of them had run
+void report(const char* name, int waiters, clock_type::time_point start,
+            clock_type::time_point woken_at) {
+    auto end = clock_type::now();
+
+    std::cout << name << ": woke " << woken << " of " << waiters
+              << " gthreads in " << microseconds(start, woken_at)
+              << " us, all done after " << microseconds(start, end) << " us"
+              << std::endl;
+}
+
+void broadcast(int waiters) {
+    woken = 0;
+
+    gthread::promise<int> p;
+    auto shared = p.get_future().share();
+
+    std::vector<gthread::future<void>> futures;
+    futures.reserve(waiters);
+
+    for (int i = 0; i < waiters; i++)
+        futures.push_back(gthread::execute([shared] {
+            shared.get();
+            woken++;
+        }));
+
+    // Let every waiter park before setting the value
+    for (int i = 0; i < 4; i++) gthread::yield();
+
+    auto start = clock_type::now();
+
+    p.set(1);
+    auto woken_at = clock_type::now();
+    for (auto& f : futures) f.get();
+
+    report("broadcast", waiters, start, woken_at);
+}
+
+void per_waiter(int waiters) {
+    woken = 0;
+
+    std::vector<gthread::promise<int>> promises(waiters);
+
+    std::vector<gthread::future<void>> futures;
+    futures.reserve(waiters);
+
+    for (auto& p : promises)
+        futures.push_back(gthread::execute([&p] {
+            p.get_future().get();
+            woken++;
+        }));
+
+    for (int i = 0; i < 4; i++) gthread::yield();
+
+    auto start = clock_type::now();
+
+    for (auto& p : promises) p.set(1);
+    auto woken_at = clock_type::now();
+    for (auto& f : futures) f.get();
+
+    report("per waiter", waiters, start, woken_at);
+}
+
+void deduplicated(int callers) {
+    gthread::single_flight<int, int> flight;
+    std::atomic<int> lookups = 0;
+
+    std::vector<gthread::future<int>> futures;
+    futures.reserve(callers);
+
+    auto start = clock_type::now();
+
+    for (int i = 0; i < callers; i++)
+        futures.push_back(gthread::execute([&] {
+            return flight
+                .run(42,
+                     [&] {
+                         lookups++;
+
+                         for (int j = 0; j < 16; j++) gthread::yield();
+
+                         return 42;
+                     })
+                .get();
+        }));
+
+    for (auto& f : futures) f.get();
+
+    std::cout << "single_flight: " << callers << " callers ran " << lookups
+              << " lookups in " << microseconds(start, clock_type::now())
+              << " us" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int waiters = argc > 1 ? atoi(argv[1]) : 10000;
+
+    // The first round also pays for allocating stacks and queue nodes
+    for (int round = 0; round < 4; round++) {
+        broadcast(waiters);
+        per_waiter(waiters);
+    }
+
+    deduplicated(waiters);
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <vector>
+
+// Measures spawn throughput for tasks that return without ever blocking,
+// and for tasks that yield once before returning. Tasks are spawned in
+// batches from a gthread, which then waits on all of them. Blocking tasks
+// each keep their stack until they stop, so a batch needs more stacks than
+// a kernel thread keeps spare by default. They are ran once more with
+// enough spare stacks for a whole batch
+
+int finish(int n) { return n; }
+
+int block(int n) {
+    gthread::yield();
+    return n;
+}
+
+void run(const char* name, int (*task)(int), int tasks, int batch) {
+    auto start = std::chrono::steady_clock::now();
+
+    auto total = gthread::execute([=] {
+                     long sum = 0;
+
+                     std::vector<gthread::future<int>> futures;
+                     futures.reserve(batch);
+
+                     for (int done = 0; done < tasks; done += batch) {
+                         for (int i = 0; i < batch; i++)
+                             futures.push_back(gthread::execute(task, i));
+
+                         // Waiting on the last one first parks this gthread
+                         // only once per batch
+                         for (auto it = futures.rbegin(); it != futures.rend();
+                              ++it)
+                             sum += it->get();
+
+                         futures.clear();
+                     }
+
+                     return sum;
+                 }).get();
+
+    auto end = std::chrono::steady_clock::now();
+    auto ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start);
+
+    std::cout << name << ": " << tasks << " tasks = " << total << ", "
+              << ns.count() / tasks << " ns/task" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int tasks = argc > 1 ? atoi(argv[1]) : 1000000;
+    int batch = argc > 2 ? atoi(argv[2]) : 1000;
+
+    for (int round = 0; round < 2; round++) {
+        run("finishing", finish, tasks, batch);
+        run("blocking", block, tasks, batch);
+    }
+
+    gthread::spare_stack_bytes = batch * gthread::default_stack_size;
+
+    run("blocking, spare stack per task", block, tasks, batch);
+}
\ No newline at end of file
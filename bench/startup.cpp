@@ -0,0 +1,35 @@
+#include <chrono>
+#include <cstdlib>
+#include <gthread.hpp>
+#include <iostream>
+#include <thread>
+
+// Measures how long it takes to create an executor, get the result of one
+// gthread and shut the executor down again, as a short lived tool would
+
+int main(int argc, char** argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100;
+    size_t threads = argc > 2 ? atoi(argv[2])
+                              : std::max(std::thread::hardware_concurrency(),
+                                         1u);
+
+    auto start = std::chrono::steady_clock::now();
+
+    long sum = 0;
+
+    for (int i = 0; i < rounds; i++) {
+        gthread::executor on(threads);
+
+        sum += gthread::execute(on, [](int n) { return n * 2; }, i).get();
+
+        on.shutdown(std::chrono::seconds(1));
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    auto us =
+        std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+    std::cout << rounds << " rounds with up to " << threads
+              << " kernel threads = " << sum << ", " << us.count() / rounds
+              << " us/round" << std::endl;
+}
\ No newline at end of file
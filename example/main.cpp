@@ -27,17 +27,19 @@ std::list<int> sort_helper(std::list<int> lhs, std::list<int> rhs) {
     {
         std::list<int> lower, upper;
         split(lhs, lower, upper);
-        f_lhs = gthread::execute(sort_helper, lower, upper);
+        f_lhs = gthread::execute(sort_helper, std::move(lower),
+                                  std::move(upper));
     }
 
     {
         std::list<int> lower, upper;
         split(rhs, lower, upper);
-        f_rhs = gthread::execute(sort_helper, lower, upper);
+        f_rhs = gthread::execute(sort_helper, std::move(lower),
+                                  std::move(upper));
     }
 
-    auto l_lhs = f_lhs.get();
-    auto l_rhs = f_rhs.get();
+    auto l_lhs = std::move(f_lhs).get();
+    auto l_rhs = std::move(f_rhs).get();
 
     std::list<int> sorted;
 
@@ -76,7 +78,7 @@ std::list<int> sort(std::list<int> unsorted) {
             upper.push_back(*it);
         }
     }
-    return sort_helper(lower, upper);
+    return sort_helper(std::move(lower), std::move(upper));
 }
 
 std::vector<int> it(int begin, int end) {
@@ -112,7 +114,7 @@ int main() {
         v.push_back(rand() % 100);
     }
 
-    auto f_v = gthread::execute(sort, v);
+    auto f_v = gthread::execute(sort, std::move(v));
 
     for (auto& value : f_v.get()) {
         std::cout << value << " ";
@@ -1,13 +1,26 @@
 #ifndef GTHREAD_HPP
 #define GTHREAD_HPP
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstddef>
 #include <functional>
+#include <future>
+#include <iosfwd>
 #include <list>
 #include <memory>
 #include <mutex>
+#include <new>
+#include <optional>
+#include <stdexcept>
 #include <thread>
 #include <tuple>
+#include <type_traits>
+#include <typeinfo>
 #include <unordered_map>
+#include <vector>
 
 namespace gthread {
 
@@ -15,8 +28,282 @@ namespace gthread {
     // to the next 16 byte boundary
     inline size_t default_stack_size = 2 * 1024 * 1024;
 
+    // The maximum number of gthreads a kernel thread will run back to back
+    // from its "run next" slot before taking a gthread from the shared queue.
+    // This keeps handoffs local without starving the rest of the queue
+    inline size_t run_next_limit = 16;
+
+    // How many bytes of stacks each kernel thread keeps from gthreads that
+    // have stopped. A new gthread runs on one of these when it first starts,
+    // so gthreads that never block don't allocate a stack of their own
+    inline size_t spare_stack_bytes = 16 * 1024 * 1024;
+
+    // Hints for where a newly created gthread should run. same_worker places
+    // the gthread in the "run next" slot of the calling kernel thread so it
+    // runs as soon as the caller yields or waits. An idle kernel thread takes
+    // it from there if the caller keeps running instead. any_worker places it
+    // at the back of the shared queue
+    enum spawn_hint { any_worker, same_worker };
+
+    // The maximum number of kernel threads used to run gthread::blocking calls.
+    // Calls made while all of them are busy wait for one to become free
+    inline size_t max_blocking_threads = 256;
+
+    // How long a kernel thread used for gthread::blocking calls waits for more
+    // work before exiting
+    inline std::chrono::milliseconds blocking_idle_timeout{10000};
+
+    // How long a kernel thread running an executor's gthreads waits for more
+    // work before exiting, as long as the executor has more than its minimum
+    // number of them
+    inline std::chrono::milliseconds worker_idle_timeout{1000};
+
+    // The default number of messages an actor handles before yielding its
+    // gthread to others
+    inline size_t default_actor_batch = 64;
+
+    class executor;
+
+    namespace __impl {
+        class gthread;
+
+        // How a new gthread is let in when its executor is at one of its
+        // limits. admit_always counts it but never refuses it,
+        // admit_if_room refuses it, and admit_when_room waits for room
+        enum admission { admit_always, admit_if_room, admit_when_room };
+
+        // A parked gthread in a list of gthreads waiting on the same thing.
+        // The node usually lives on the waiting gthread's own stack
+        struct parked_waiter {
+            std::shared_ptr<gthread> thread;
+            parked_waiter* next = nullptr;
+        };
+
+        // Gives the rest of the library access to the scheduling internals
+        // of executors, see its definition below
+        struct scheduler;
+    }  // namespace __impl
+
+    // Limits on the gthreads of an executor, used to push back on bursts of
+    // work before they run out of memory. Zero means no limit. A gthread is
+    // live from when it is created until it exits, and queued until it first
+    // runs. Stack bytes are counted for every live gthread, including the
+    // ones that have not allocated their stack yet, and for the spare stacks
+    // kept by kernel threads. Spare stacks are freed when they are all that
+    // keeps a gthread from being created
+    struct admission_limits {
+        size_t max_live = 0;
+        size_t max_queued = 0;
+        size_t max_stack_bytes = 0;
+    };
+
+    // The load on an executor at one point in time. waiting counts the
+    // gthreads waiting for room to create a gthread, and rejected how many
+    // times try_execute has been refused
+    struct admission_metrics {
+        size_t live = 0;
+        size_t queued = 0;
+        size_t stack_bytes = 0;
+        size_t waiting = 0;
+        uint64_t rejected = 0;
+    };
+
+    // Passed to execute to wait for room under the executor's limits instead
+    // of going over them
+    struct wait_for_capacity_t {
+        explicit wait_for_capacity_t() = default;
+    };
+
+    inline constexpr wait_for_capacity_t wait_for_capacity{};
+
+    // Stops the current gthread from being preempted while in scope. Hold one
+    // while holding a lock that other gthreads may take, or while calling code
+    // that is not safe to switch away from. If a preemption was requested
+    // while held, the gthread yields when the last guard goes out of scope.
+    // Does nothing outside of a gthread
+    class no_preempt {
+    private:
+        __impl::gthread* thread;
+
+    public:
+        no_preempt();
+        ~no_preempt();
+
+        no_preempt(const no_preempt&) = delete;
+        no_preempt& operator=(const no_preempt&) = delete;
+    };
+
+    // Allocates size bytes. Sizes up to max_small_allocation are served from
+    // size class slabs cached by the calling kernel thread, so a gthread that
+    // moves between kernel threads still allocates without taking a lock most
+    // of the time. Larger sizes use operator new. The memory is aligned to 16
+    // bytes
+    void* allocate(size_t size);
+
+    // Frees memory returned by allocate. size must be the size passed to
+    // allocate
+    void deallocate(void* pointer, size_t size) noexcept;
+
+    // The largest size served from the size class slabs
+    inline constexpr size_t max_small_allocation = 4096;
+
+    // An allocator for standard containers that uses gthread::allocate
+    template <typename Type>
+    class allocator {
+    public:
+        using value_type = Type;
+
+        allocator() noexcept = default;
+
+        template <typename Other>
+        allocator(const allocator<Other>&) noexcept {}
+
+        Type* allocate(size_t count) {
+            static_assert(alignof(Type) <= 16,
+                          "gthread::allocator only aligns to 16 bytes");
+
+            return static_cast<Type*>(
+                ::gthread::allocate(count * sizeof(Type)));
+        }
+
+        void deallocate(Type* pointer, size_t count) noexcept {
+            ::gthread::deallocate(pointer, count * sizeof(Type));
+        }
+
+        template <typename Other>
+        friend bool operator==(const allocator&, const allocator<Other>&) {
+            return true;
+        }
+
+        template <typename Other>
+        friend bool operator!=(const allocator&, const allocator<Other>&) {
+            return false;
+        }
+    };
+
+    // Bump allocates memory that is only freed all at once by reset or when
+    // the arena is destroyed. Every gthread has one, see task_arena
+    class arena {
+    private:
+        struct block {
+            block* next;
+            size_t size;
+        };
+
+        block* blocks = nullptr;
+        char* cursor = nullptr;
+        char* limit = nullptr;
+
+        // Allocates a new block that fits at least size bytes
+        void grow(size_t size, size_t alignment);
+
+    public:
+        arena() = default;
+        ~arena() { reset(); }
+
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        // Returns size bytes aligned to alignment, which must be a power of
+        // two
+        void* allocate(size_t size,
+                       size_t alignment = alignof(std::max_align_t)) {
+            auto aligned = reinterpret_cast<char*>(
+                (reinterpret_cast<uintptr_t>(cursor) + alignment - 1) &
+                ~(alignment - 1));
+
+            if (!cursor || aligned + size > limit) {
+                grow(size, alignment);
+                return allocate(size, alignment);
+            }
+
+            cursor = aligned + size;
+            return aligned;
+        }
+
+        // Frees everything allocated from the arena
+        void reset() noexcept;
+    };
+
+    // Returns the arena of the current gthread. Everything allocated from it
+    // is freed when the gthread exits, so it must not outlive the gthread. If
+    // this is called without a current gthread, an exception is thrown
+    arena& task_arena();
+
+    // An allocator for standard containers that allocates from an arena.
+    // Deallocation does nothing, the memory is freed when the arena is reset
+    template <typename Type>
+    class arena_allocator {
+        template <typename Other>
+        friend class arena_allocator;
+
+    private:
+        arena* owner;
+
+    public:
+        using value_type = Type;
+
+        // Allocates from the arena of the current gthread
+        arena_allocator() : owner{&task_arena()} {}
+
+        arena_allocator(arena& owner) noexcept : owner{&owner} {}
+
+        template <typename Other>
+        arena_allocator(const arena_allocator<Other>& other) noexcept
+            : owner{other.owner} {}
+
+        Type* allocate(size_t count) {
+            return static_cast<Type*>(
+                owner->allocate(count * sizeof(Type), alignof(Type)));
+        }
+
+        void deallocate(Type*, size_t) noexcept {}
+
+        template <typename Other>
+        friend bool operator==(const arena_allocator& lhs,
+                               const arena_allocator<Other>& rhs) {
+            return lhs.owner == rhs.owner;
+        }
+
+        template <typename Other>
+        friend bool operator!=(const arena_allocator& lhs,
+                               const arena_allocator<Other>& rhs) {
+            return lhs.owner != rhs.owner;
+        }
+    };
+
     namespace __impl {
 
+        // Creates a Type with gthread::allocate
+        template <typename Type, typename... Args>
+        Type* create(Args&&... args) {
+            if constexpr (alignof(Type) > 16)
+                return new Type{std::forward<Args>(args)...};
+
+            else {
+                auto pointer = allocate(sizeof(Type));
+
+                try {
+                    return new (pointer) Type{std::forward<Args>(args)...};
+                } catch (...) {
+                    deallocate(pointer, sizeof(Type));
+                    throw;
+                }
+            }
+        }
+
+        // Destroys a Type created with create
+        template <typename Type>
+        void destroy(Type* pointer) {
+            if constexpr (alignof(Type) > 16)
+                delete pointer;
+
+            else {
+                pointer->~Type();
+                deallocate(pointer, sizeof(Type));
+            }
+        }
+
         // Base class that all platform specific green thread classes inherits
         // from. GThreads are lazily setup when it's time to switch to them
         class gthread {
@@ -26,6 +313,7 @@ namespace gthread {
         private:
             uint32_t flag_is_setup : 1;
             uint32_t flag_is_stopped : 1;
+            uint32_t flag_is_parked : 1;
 
         protected:
             Function function;
@@ -41,6 +329,7 @@ namespace gthread {
                   stack_size{stack_size} {
                 flag_is_setup = is_setup ? 1 : 0;
                 flag_is_stopped = 0;
+                flag_is_parked = 0;
             }
 
             // Platform specific setup happens here. This is called after the
@@ -48,31 +337,119 @@ namespace gthread {
             virtual void platform_setup() = 0;
 
             // Platform specific context switch happens here
-            virtual void platform_swap(std::shared_ptr<gthread> next) = 0;
+            virtual void platform_swap(
+                const std::shared_ptr<gthread>& next) = 0;
+
+            // The first function ran by every gthread, which is passed the
+            // gthread itself. This calls function(user_params)
+            static void entry(void* self) {
+                auto thread = static_cast<gthread*>(self);
+
+                thread->preempt_pending = 0;
+                thread->preemptible = thread->no_preempt_depth == 0;
+
+                thread->function(thread->user_params);
+            }
 
         public:
+            // Set while the gthread may be preempted. This is read from the
+            // preemption signal handler on the kernel thread running it
+            volatile sig_atomic_t preemptible = 0;
+
+            // Set when a preemption was requested while the gthread could not
+            // be preempted. The gthread yields once it can be
+            volatile sig_atomic_t preempt_pending = 0;
+
+            // The number of no_preempt guards held by the gthread
+            uint32_t no_preempt_depth = 0;
+
+            // The executor the gthread is queued on
+            executor* owner = nullptr;
+
+            // The function the gthread was created to run, used by the
+            // profiler. spawn_address is only set for plain functions
+            const std::type_info* spawn_type = nullptr;
+            void* spawn_address = nullptr;
+
+            // Freed when the gthread exits, see task_arena
+            ::gthread::arena arena;
+
+            // Called with the user params instead of function when the
+            // gthread is dropped before it ever ran
+            Function discard = nullptr;
+
             virtual ~gthread() {}
 
             // A helper function that setups up the gthread if it's not already.
             // Also allocates the stack if needed. Then platform_swap is called
-            inline void swap(std::shared_ptr<gthread> next) {
+            inline void swap(const std::shared_ptr<gthread>& next) {
+                preemptible = 0;
+
                 if (!next->flag_is_setup) {
-                    next->stack = std::unique_ptr<uint64_t[]>(
-                        new uint64_t[next->stack_size / 8]);
+                    if (!next->stack)
+                        next->stack = std::unique_ptr<uint64_t[]>(
+                            new uint64_t[next->stack_size / 8]);
+
                     next->platform_setup();
                     next->flag_is_setup = 1;
                 }
 
                 platform_swap(next);
+
+                // Running again, possibly on a different kernel thread
+                preempt_pending = 0;
+                preemptible = no_preempt_depth == 0;
             }
 
             // Return true if the green thread is stopped and needs to be
             // cleaned up
             inline bool is_stopped() const { return flag_is_stopped; }
 
+            // Frees what a gthread that never ran was given, see discard
+            inline void drop() {
+                if (flag_is_setup || !discard) return;
+
+                discard(user_params);
+                discard = nullptr;
+            }
+
+            // Return true once the green thread has been ran at least once
+            inline bool is_setup() const { return flag_is_setup; }
+
+            inline size_t get_stack_size() const { return stack_size; }
+
             // Stops the green thread
             inline void stop() { flag_is_stopped = 1; }
 
+            // Gives a gthread that is not setup yet a stack to run on, which
+            // must be stack_size bytes
+            inline void use_stack(std::unique_ptr<uint64_t[]> memory) {
+                stack = std::move(memory);
+            }
+
+            // Takes the stack of a stopped gthread so that it can be used by
+            // another one
+            inline std::unique_ptr<uint64_t[]> take_stack() {
+                return std::move(stack);
+            }
+
+            // Returns the bounds of the gthread's stack, or nullptr if it has
+            // not been allocated yet
+            inline const void* stack_begin() const { return stack.get(); }
+            inline const void* stack_end() const {
+                return stack ? stack.get() + stack_size / 8 : nullptr;
+            }
+
+            // Return true if the green thread is waiting to be woken up and
+            // must not be put back into the queue by the scheduler
+            inline bool is_parked() const { return flag_is_parked; }
+
+            // Marks the green thread as waiting to be woken up
+            inline void park() { flag_is_parked = 1; }
+
+            // Marks the green thread as runnable again
+            inline void unpark() { flag_is_parked = 0; }
+
             // Creates a regular green thread
             static std::shared_ptr<gthread> create_default(Function function,
                                                            void* user_params,
@@ -83,72 +460,473 @@ namespace gthread {
             static std::shared_ptr<gthread> create_scheduling();
         };
 
+        // A lock for state that is nearly always taken by the same kernel
+        // thread, so that waiting for it is rare and short
+        class spin_lock {
+        private:
+            std::atomic_flag flag = ATOMIC_FLAG_INIT;
+
+        public:
+            void lock() {
+                while (flag.test_and_set(std::memory_order_acquire))
+                    std::this_thread::yield();
+            }
+
+            void unlock() { flag.clear(std::memory_order_release); }
+        };
+
         // A helper class that holds the scheduling and current threads. Each
-        // kernel thread has exactly one of these
+        // kernel thread has one of these for every executor it runs
         class context {
-            friend struct kernel_threads_manager;
+            friend class ::gthread::executor;
 
         public:
             std::shared_ptr<gthread> scheduling;
             std::shared_ptr<gthread> current;
 
+            // The executor whose gthreads are ran by this context
+            executor* owner = nullptr;
+
+            // The gthread to run after the current one. Idle kernel threads
+            // of the same executor take it while this one is busy running a
+            // gthread, so it is guarded by next_lock
+            std::shared_ptr<gthread> next;
+            spin_lock next_lock;
+
+            // How many gthreads have been ran from next in a row
+            size_t next_streak = 0;
+
+            // Stacks left behind by gthreads that stopped on this kernel
+            // thread, all of spare_stack_size bytes. A gthread starting on
+            // this kernel thread runs on one of these, so one that never
+            // parks or yields hands it back before the next gthread starts.
+            // The executor frees them from other kernel threads when it needs
+            // the room, so they are guarded by spare_lock
+            std::vector<std::unique_ptr<uint64_t[]>> spare_stacks;
+            size_t spare_stack_size = 0;
+            spin_lock spare_lock;
+
+            // Called by the scheduler once the current gthread has been parked
+            // and fully switched out. If it returns false, the gthread is not
+            // parked after all and is ran again
+            bool (*park_commit)(void*) = nullptr;
+            void* park_arg = nullptr;
+
+            // The gthread being ran by the scheduler, and how many times the
+            // scheduler has switched to a gthread. These are read by the
+            // preemption monitor and signal handler
+            std::atomic<gthread*> running = nullptr;
+            std::atomic<uint64_t> run_count = 0;
+
         private:
-            context(std::shared_ptr<gthread>& scheduling)
-                : scheduling{scheduling} {}
+            context(std::shared_ptr<gthread>& scheduling, executor* owner)
+                : scheduling{scheduling}, owner{owner} {}
 
         public:
             context() = default;
             context(context&& other)
                 : scheduling{std::move(other.scheduling)},
-                  current{std::move(other.current)} {}
+                  current{std::move(other.current)},
+                  owner{other.owner},
+                  next{std::move(other.next)},
+                  next_streak{other.next_streak},
+                  spare_stacks{std::move(other.spare_stacks)},
+                  spare_stack_size{other.spare_stack_size},
+                  park_commit{other.park_commit},
+                  park_arg{other.park_arg},
+                  running{other.running.load()},
+                  run_count{other.run_count.load()} {}
             context(const context&) = delete;
 
             context& operator=(context&& other) {
                 scheduling = std::move(other.scheduling);
                 current = std::move(other.current);
+                owner = other.owner;
+                next = std::move(other.next);
+                next_streak = other.next_streak;
+                spare_stacks = std::move(other.spare_stacks);
+                spare_stack_size = other.spare_stack_size;
+                park_commit = other.park_commit;
+                park_arg = other.park_arg;
+                running = other.running.load();
+                run_count = other.run_count.load();
                 return *this;
             }
 
             context& operator=(const context&) = delete;
         };
 
-        // Handles the creation and destruction of kernel threads. Also has
-        // functions to manage the current gthread and houses the scheduler
-        struct kernel_threads_manager {
-            std::unordered_map<std::thread::id, context> contexts;
-            std::list<std::shared_ptr<gthread>> green_threads;
+    }  // namespace __impl
+
+    // Runs gthreads on its own kernel threads with its own queue. gthreads
+    // created from a gthread are queued on the same executor unless another
+    // one is given, so work can be kept apart from other work. An executor
+    // can also be ran from a kernel thread the caller already owns with
+    // run_one, run_for and run_until_idle
+    class executor {
+        friend struct __impl::scheduler;
+
+    public:
+        // Creates an executor without kernel threads. Use start to create
+        // them, or run it from existing kernel threads
+        executor() = default;
+
+        // Creates an executor with up to thread_count kernel threads
+        explicit executor(size_t thread_count) { start(thread_count); }
+
+        executor(const executor&) = delete;
+        executor& operator=(const executor&) = delete;
+
+        // Calls finish when destroyed, or after main() returns
+        ~executor() { finish(); }
+
+        // Sets up the calling kernel thread and allows up to
+        // hardware_concurrency() - 1 more kernel threads
+        void init();
+
+        // Allows up to thread_count kernel threads to run the executor's
+        // gthreads. Only the minimum set by set_worker_limits are created
+        // right away, the rest are created as gthreads are queued
+        void start(size_t thread_count);
+
+        // Sets how many kernel threads run the executor's gthreads. At least
+        // min_count are kept running, and no more than max_count are created
+        void set_worker_limits(size_t min_count, size_t max_count);
+
+        // Runs every queued gthread, with the help of the calling kernel
+        // thread unless it is running a gthread, and cleans up the kernel
+        // threads. An executor without kernel threads is drained by the
+        // calling kernel thread alone
+        void finish();
+
+        // Stops the executor. Queued gthreads are ran until none are left or
+        // drain_deadline has passed, with the help of the calling kernel
+        // thread. The kernel threads are then cleaned up, and gthreads that
+        // are still queued are destroyed along with their stacks. Those that
+        // never started destroy their function and arguments, and their
+        // futures get a std::future_error with broken_promise. Gthreads woken
+        // by that are destroyed too. The futures of those that had started
+        // are never set. Returns true if every queued gthread was ran. This
+        // can't be called from a gthread of this executor
+        bool shutdown(std::chrono::nanoseconds drain_deadline);
+
+        // Runs at most one gthread on the calling kernel thread. Returns
+        // true if a gthread was ran. This can't be called from a gthread
+        bool run_one();
+
+        // Runs gthreads on the calling kernel thread until duration has
+        // passed or there are none left to run. Returns how many were ran.
+        // This can't be called from a gthread
+        size_t run_for(std::chrono::nanoseconds duration);
+
+        // Runs gthreads on the calling kernel thread until there are none
+        // left to run. Returns how many were ran. This can't be called from
+        // a gthread
+        size_t run_until_idle();
+
+        // Starts the preemption monitor. Throws if preemption is not
+        // supported on the platform
+        void enable_preemption(std::chrono::microseconds slice);
+
+        // Stops the preemption monitor
+        void disable_preemption();
+
+        // Sets the limits used by try_execute and by execute with
+        // wait_for_capacity. Plain execute is counted, but never refused
+        void set_limits(const admission_limits& new_limits);
+
+        admission_limits limits() const;
+
+        admission_metrics metrics() const;
+
+        // Returns the executor of the scheduler running on the calling
+        // kernel thread. Kernel threads that don't run a scheduler get the
+        // default executor
+        static executor& current();
+
+    private:
+        using context = __impl::context;
+
+        std::unordered_map<std::thread::id, context> contexts;
+        std::list<std::shared_ptr<__impl::gthread>,
+                  allocator<std::shared_ptr<__impl::gthread>>>
+            green_threads;
+        std::mutex lock;
+
+        bool running = true;
+
+        // Kernel threads running the executor's gthreads. They are started
+        // as gthreads are queued, up to max_workers, and exit after being
+        // idle for worker_idle_timeout while there are more than min_workers.
+        // These are guarded by lock
+        std::unordered_map<std::thread::id, std::thread> threads;
+        std::list<std::thread> retired_threads;
+        size_t min_workers = 0;
+        size_t max_workers = 0;
+        std::atomic<size_t> idle_workers = 0;
+        std::condition_variable work_available;
+
+        // Set by shutdown. Kernel threads stop running gthreads once it
+        // passes, even if some are still queued
+        std::chrono::steady_clock::time_point drain_deadline =
+            std::chrono::steady_clock::time_point::max();
+
+        // Every kernel thread running a scheduler, used to deliver
+        // preemption signals
+        std::list<std::pair<context*, std::thread::native_handle_type>>
+            kernel_thread_handles;
+
+        // Sends preemption signals to kernel threads that have been running
+        // the same gthread for longer than the time slice
+        std::thread preemption_monitor;
+        std::mutex preemption_lock;
+        std::condition_variable preemption_stop;
+        bool preemption_enabled = false;
+
+        // Admission control, see set_limits
+        std::atomic<size_t> max_live = 0;
+        std::atomic<size_t> max_queued = 0;
+        std::atomic<size_t> max_stack_bytes = 0;
+
+        std::atomic<size_t> live_count = 0;
+        std::atomic<size_t> queued_count = 0;
+        std::atomic<size_t> stack_bytes = 0;
+        std::atomic<uint64_t> rejected_count = 0;
+
+        // Bytes of the spare stacks kept by kernel threads, which are also
+        // counted in stack_bytes
+        std::atomic<size_t> spare_bytes = 0;
+
+        // gthreads waiting for room to create a gthread with a stack of the
+        // given size, woken in order once there is room
+        std::mutex admission_lock;
+        std::list<std::pair<std::shared_ptr<__impl::gthread>, size_t>>
+            waiting_spawners;
+        std::atomic<size_t> waiting_count = 0;
+
+        // Sets up the scheduling green thread and a context for the kernel
+        // thread, or returns the existing one
+        context& setup_kernel_thread_context();
+
+        // Removes the context of the calling kernel thread before it exits.
+        // lock must be held
+        void remove_kernel_thread_context();
+
+        // Wakes an idle kernel thread, or creates one if none are idle and
+        // the limit allows it. lock must be held
+        void notify_worker();
+
+        // Creates a kernel thread running run_worker. lock must be held
+        void add_worker();
+
+        // Runs gthreads until the kernel thread retires or the executor
+        // stops
+        void run_worker();
+
+        // Moves a gthread waiting in the "run next" slot of a kernel thread
+        // that is busy running another gthread to the shared queue. Returns
+        // false if there is none. lock must be held
+        bool steal_next();
+
+        // Tells the kernel threads to stop once the queue is empty or
+        // deadline has passed, and waits for them
+        void stop_workers(std::chrono::steady_clock::time_point deadline);
+
+        // Queues a new gthread. same_worker places it in the "run next"
+        // slot of the calling kernel thread when called from a gthread of
+        // this executor. An idle kernel thread is woken to take it from
+        // there in case the caller keeps running
+        void spawn_green_thread(std::shared_ptr<__impl::gthread> thread,
+                                spawn_hint hint);
+
+        // Runs green threads on the calling kernel thread, returning when
+        // none are left to run, max_count have been ran or deadline has
+        // passed. Returns how many were ran
+        size_t process_green_threads(
+            size_t max_count = SIZE_MAX,
+            std::chrono::steady_clock::time_point deadline =
+                std::chrono::steady_clock::time_point::max());
+
+        // Counts a new gthread with a stack of stack_size bytes against the
+        // limits. Returns false if mode is admit_if_room and there is no
+        // room. With admit_when_room, the calling gthread is parked until
+        // there is room, and a kernel thread runs the scheduler instead
+        bool admit_green_thread(size_t stack_size, __impl::admission mode);
+
+        // Counts a new gthread if that stays within the limits, freeing spare
+        // stacks if they are in the way. Returns false without counting it
+        // otherwise
+        bool reserve_green_thread(size_t stack_size);
+
+        // Counts a gthread as no longer queued once it first runs
+        void start_green_thread();
+
+        // Gives back what a stopped gthread counted against the limits
+        void release_green_thread(size_t stack_size);
+
+        // Gives back what was counted for a gthread that never started, such
+        // as one that could not be created after it was admitted
+        void cancel_green_thread(size_t stack_size);
+
+        // Counts and wakes gthreads waiting for room, in order, for as long
+        // as there is room for them
+        void admit_waiting_spawners();
+
+        // Starts a gthread that is about to run for the first time on a
+        // spare stack of the kernel thread, if there is one of its size
+        void reuse_stack(context& ctx, __impl::gthread& thread);
+
+        // Keeps the stack of a stopped gthread for the next gthread to start
+        // on the kernel thread. Returns true if it was kept, in which case
+        // its bytes stay counted
+        bool keep_stack(context& ctx, __impl::gthread& thread);
+
+        // Frees the spare stacks of one kernel thread, or of all of them
+        void release_spare_stacks(context& ctx);
+        void release_spare_stacks();
+
+        // Returns the context of the scheduler running on the calling kernel
+        // thread, or nullptr if there is none
+        static context* find_kernel_thread_context();
+
+        // Returns the gthread running on the calling kernel thread, or
+        // nullptr if called from outside of a gthread
+        static std::shared_ptr<__impl::gthread> current_green_thread();
+
+        // Yields the current gthread. If this is called without a current
+        // gthread, the scheduler is ran
+        static void yield_current_green_thread();
+
+        // Exits the current gthread. If this is called without a current
+        // gthread, an exception is thrown
+        static void exit_current_green_thread();
+
+        // Parks the current gthread until wake_green_thread is called on it.
+        // Once the gthread is fully switched out, commit(arg) is called from
+        // the scheduler. This is where the gthread is published to whoever
+        // wakes it, so that it can't be woken before it has stopped running.
+        // If commit returns false, the gthread is ran again instead. If this
+        // is called without a current gthread, an exception is thrown
+        static void park_current_green_thread(bool (*commit)(void*),
+                                              void* arg);
+
+        // Parks the current gthread until wake_green_thread is called on it.
+        // lock must be locked by the caller, it is unlocked once the gthread
+        // is fully switched out. If this is called without a current gthread,
+        // an exception is thrown
+        static void park_current_green_thread(
+            std::unique_lock<std::mutex>& lock);
+
+        // Makes a parked gthread runnable again on its executor. When called
+        // from a gthread of the same executor, it goes in the caller's "run
+        // next" slot, otherwise at the back of the shared queue
+        static void wake_green_thread(std::shared_ptr<__impl::gthread> thread);
+
+        // Makes every parked gthread in the list runnable again at once,
+        // queueing them with one lock of their executor. The list is newest
+        // first, and its gthreads are queued oldest first. A list of one is
+        // woken like wake_green_thread does. The nodes may be freed as soon
+        // as their gthread is queued
+        static void wake_green_threads(__impl::parked_waiter* newest);
+    };
+
+    namespace __impl {
+
+        // The parts of executor that the library's own primitives, such as
+        // futures, actors and pipeline gates, are built on
+        struct scheduler {
+            static context* find_kernel_thread_context() {
+                return executor::find_kernel_thread_context();
+            }
+
+            static std::shared_ptr<gthread> current_green_thread() {
+                return executor::current_green_thread();
+            }
+
+            static void yield_current_green_thread() {
+                executor::yield_current_green_thread();
+            }
+
+            static void exit_current_green_thread() {
+                executor::exit_current_green_thread();
+            }
+
+            static void park_current_green_thread(bool (*commit)(void*),
+                                                  void* arg) {
+                executor::park_current_green_thread(commit, arg);
+            }
+
+            static void park_current_green_thread(
+                std::unique_lock<std::mutex>& lock) {
+                executor::park_current_green_thread(lock);
+            }
+
+            static void wake_green_thread(std::shared_ptr<gthread> thread) {
+                executor::wake_green_thread(std::move(thread));
+            }
+
+            static void wake_green_threads(parked_waiter* newest) {
+                executor::wake_green_threads(newest);
+            }
+
+            static bool admit_green_thread(executor& on, size_t stack_size,
+                                           admission mode) {
+                return on.admit_green_thread(stack_size, mode);
+            }
+
+            static void cancel_green_thread(executor& on, size_t stack_size) {
+                on.cancel_green_thread(stack_size);
+            }
+
+            static void spawn_green_thread(executor& on,
+                                           std::shared_ptr<gthread> thread,
+                                           spawn_hint hint) {
+                on.spawn_green_thread(std::move(thread), hint);
+            }
+        };
+
+        // A pool of kernel threads separate from the scheduler that runs
+        // functions which block the kernel thread. Threads are created when
+        // work is submitted and none are idle, and exit after being idle for
+        // blocking_idle_timeout
+        struct blocking_pool {
+            using Function = void (*)(void*);
+
+            std::list<std::pair<Function, void*>> jobs;
             std::mutex lock;
+            std::condition_variable available;
 
             bool running = true;
 
-            std::list<std::thread> threads;
+            size_t idle_count = 0;
 
-            // Creates the kernel threads and sets up all kernel threads
-            void init();
+            std::unordered_map<std::thread::id, std::thread> threads;
 
-            // Cleans up kernel threads
-            void finish();
-
-            // Calls finish after main() returns
-            ~kernel_threads_manager() { finish(); }
+            // Threads that have exited after being idle, but not joined yet
+            std::list<std::thread> retired;
 
-            // Sets up the scheduling green thread and a context for the kernel
-            // thread
-            void setup_kernel_thread_context();
+            // Queues function(user_params) to run on one of the pool's threads.
+            // Once the pool is finished, it is ran on the calling thread
+            void submit(Function function, void* user_params);
 
-            // Runs all the green threads, only returning when all are processed
-            void process_green_threads();
+            // Runs queued jobs until the pool is finished or the thread has
+            // been idle for too long
+            void run();
 
-            // Yields the current gthread. If this is called without a current
-            // gthread, the scheduler is ran
-            void yield_current_green_thread();
+            // Runs the remaining jobs and cleans up the kernel threads
+            void finish();
 
-            // Exits the current gthread. If this is called without a current
-            // gthread, an exception is thrown
-            void exit_current_green_thread();
+            // Calls finish after main() returns
+            ~blocking_pool() { finish(); }
         };
 
-        inline kernel_threads_manager kernel_threads;
+        // Declared before the default executor so that it outlives it, as
+        // gthreads ran by ~executor may still make blocking calls
+        inline blocking_pool blocking_threads;
+
+        // The default executor, used by gthreads created outside of any
+        // executor
+        inline executor kernel_threads;
 
 #ifdef GTHREAD_INIT_ON_START
         struct gthread_init_on_start {
@@ -158,64 +936,211 @@ namespace gthread {
         inline gthread_init_on_start init_on_start;
 #endif
 
-        // A helper class to manage the shared state of any promise future pair
+        // A helper class to manage the shared state of any promise future pair.
+        // The state is a single allocation holding the value inline, and is
+        // freed when the last reference to it is released
         template <typename Type>
         class shared_state {
         private:
+            static constexpr uint32_t flag_data = 1;
+            static constexpr uint32_t flag_exception = 2;
+
+            // Marks the list of waiters as closed once the promise is
+            // fulfilled, so that no more gthreads are added to it
+            static inline parked_waiter closed;
+
             struct State {
-                std::unique_ptr<Type> data;
+                std::atomic<uint32_t> references = 1;
+
+                // flag_data and flag_exception are set once the promise is
+                // fulfilled
+                std::atomic<uint32_t> flags = 0;
+
+                alignas(Type) unsigned char data[sizeof(Type)];
                 std::exception_ptr exception;
+
+                // The gthreads parked on the state, or closed
+                std::atomic<parked_waiter*> waiters = nullptr;
+
+                Type* get() {
+                    return std::launder(reinterpret_cast<Type*>(data));
+                }
+
+                static void* operator new(size_t size) {
+                    return ::gthread::allocate(size);
+                }
+
+                static void operator delete(void* pointer, size_t size) {
+                    ::gthread::deallocate(pointer, size);
+                }
+
+                ~State() {
+                    if (flags.load(std::memory_order_relaxed) & flag_data)
+                        get()->~Type();
+                }
+            };
+
+            State* state = nullptr;
+
+            void acquire() {
+                if (state) state->references.fetch_add(1);
+            }
+
+            void release() {
+                // Skip the atomic decrement when this is the only reference
+                if (state && (state->references.load() == 1 ||
+                              state->references.fetch_sub(1) == 1))
+                    delete state;
+
+                state = nullptr;
+            }
+
+            bool is_ready() const noexcept {
+                return state->flags.load() & (flag_data | flag_exception);
+            }
+
+            struct waiter : parked_waiter {
+                State* state;
             };
 
-            std::shared_ptr<State> state;
+            // Called by the scheduler after the waiting gthread is switched
+            // out. Adds it to the list of waiters, unless the promise was
+            // fulfilled in the meantime
+            static bool commit_wait(void* pointer) {
+                auto node = static_cast<waiter*>(pointer);
+                auto& waiters = node->state->waiters;
+
+                auto head = waiters.load();
+
+                do {
+                    if (head == &closed) {
+                        node->thread = nullptr;
+                        return false;
+                    }
+
+                    node->next = head;
+                } while (!waiters.compare_exchange_weak(head, node));
+
+                return true;
+            }
+
+            // Marks the state as fulfilled and wakes every gthread waiting on
+            // the state in one batch
+            void notify(uint32_t flag) {
+                state->flags.fetch_or(flag);
+
+                auto waiters = state->waiters.exchange(&closed);
+
+                if (!waiters || waiters == &closed) return;
+
+                scheduler::wake_green_threads(waiters);
+            }
 
         public:
-            inline shared_state() {
-                state = std::make_shared<State>();
-                state->exception = nullptr;
+            // Creates an empty shared_state without any state. Use create to
+            // allocate one
+            shared_state() = default;
+
+            static shared_state create() {
+                shared_state result;
+                result.state = new State;
+                return result;
             }
 
             inline shared_state(shared_state&& other) noexcept
-                : state{std::move(other.state)} {}
+                : state{other.state} {
+                other.state = nullptr;
+            }
+
             inline shared_state(const shared_state& other) noexcept
-                : state{other.state} {}
+                : state{other.state} {
+                acquire();
+            }
+
+            ~shared_state() { release(); }
 
             shared_state& operator=(shared_state&& other) noexcept {
-                state = std::move(other.state);
+                if (this != &other) {
+                    release();
+                    state = other.state;
+                    other.state = nullptr;
+                }
+
                 return *this;
             }
 
             shared_state& operator=(const shared_state& other) noexcept {
-                state = other.state;
+                if (state != other.state) {
+                    release();
+                    state = other.state;
+                    acquire();
+                }
+
                 return *this;
             }
 
+            bool valid() const noexcept { return state != nullptr; }
+
             bool has_data() const noexcept {
-                return state != nullptr && state->data != nullptr;
+                return state != nullptr && (state->flags.load() & flag_data);
             }
 
             bool has_exception() const noexcept {
-                return state != nullptr && state->exception != nullptr;
+                return state != nullptr &&
+                       (state->flags.load() & flag_exception);
+            }
+
+            // Waits until data or an exception has been set. A gthread is
+            // parked until the promise wakes it up. Outside of a gthread, the
+            // scheduler is ran until the state is ready
+            void wait() const {
+                if (is_ready()) return;
+
+                no_preempt preempt_guard;
+
+                auto current = scheduler::current_green_thread();
+
+                if (!current) {
+                    while (!is_ready()) scheduler::yield_current_green_thread();
+
+                    return;
+                }
+
+                waiter node;
+                node.state = state;
+
+                while (!is_ready()) {
+                    node.thread = current;
+                    scheduler::park_current_green_thread(commit_wait, &node);
+                }
             }
 
-            const Type& get_data() const { return *state->data; }
+            const Type& get_data() const { return *state->get(); }
 
-            Type& get_data() { return *state->data; }
+            Type& get_data() { return *state->get(); }
 
             void set_data(Type&& value) {
-                if (!has_data())
-                    state->data = std::make_unique<Type>(std::move(value));
+                no_preempt preempt_guard;
+
+                if (has_data()) {
+                    get_data() = std::move(value);
+                    return;
+                }
 
-                else
-                    *state->data = std::move(value);
+                new (state->data) Type(std::move(value));
+                notify(flag_data);
             }
 
             void set_data(const Type& value) {
-                if (!has_data())
-                    state->data = std::make_unique<Type>(value);
+                no_preempt preempt_guard;
 
-                else
-                    *state->data = value;
+                if (has_data()) {
+                    get_data() = value;
+                    return;
+                }
+
+                new (state->data) Type(value);
+                notify(flag_data);
             }
 
             const std::exception_ptr& get_exception() const {
@@ -225,7 +1150,10 @@ namespace gthread {
             std::exception_ptr& get_exception() { return state->exception; }
 
             void set_exception(const std::exception_ptr& e) {
+                no_preempt preempt_guard;
+
                 state->exception = e;
+                notify(flag_exception);
             }
 
             friend bool operator==(const shared_state& lhs,
@@ -243,11 +1171,15 @@ namespace gthread {
     template <typename Type>
     class promise;
 
+    template <typename Type>
+    class shared_future;
+
     // A custom version of std::future that yields the current gthread instead
     // of blocking the current
     template <typename Type>
     class future {
         friend promise<Type>;
+        friend shared_future<Type>;
 
     private:
         __impl::shared_state<Type> state;
@@ -266,13 +1198,10 @@ namespace gthread {
 
         future& operator=(const future&) = delete;
 
-        // Yields if data has not been set by the corrsponding promise object
-        void wait() const {
-            while (!state.has_data() && !state.has_exception())
-                __impl::kernel_threads.yield_current_green_thread();
-        }
+        // Waits until data has been set by the corrsponding promise object
+        void wait() const { state.wait(); }
 
-        const Type& get() const {
+        const Type& get() const& {
             wait();
 
             if (state.has_exception())
@@ -281,7 +1210,7 @@ namespace gthread {
             return state.get_data();
         }
 
-        Type& get() {
+        Type& get() & {
             wait();
 
             if (state.has_exception())
@@ -290,6 +1219,20 @@ namespace gthread {
             return state.get_data();
         }
 
+        // Moves the value out of the future instead of copying it
+        Type get() && {
+            wait();
+
+            if (state.has_exception())
+                std::rethrow_exception(state.get_exception());
+
+            return std::move(state.get_data());
+        }
+
+        // Returns false for a future that has no promise, such as one that
+        // was default constructed or moved from
+        bool valid() const { return state.valid(); }
+
         bool has_data() const { return state.has_data(); }
 
         bool has_exception() const { return state.has_exception(); }
@@ -301,6 +1244,12 @@ namespace gthread {
         std::exception_ptr& exception() { return state.get_exception(); }
 
         operator bool() const { return state.has_data(); }
+
+        // Turns the future into one that can be copied and waited on by any
+        // number of gthreads. The future is no longer valid afterwards
+        shared_future<Type> share() {
+            return shared_future<Type>(std::move(*this));
+        }
     };
 
     // A custom version of std::future that yields the current gthread instead
@@ -308,6 +1257,7 @@ namespace gthread {
     template <>
     class future<void> {
         friend promise<void>;
+        friend shared_future<void>;
 
     private:
         __impl::shared_state<bool> state;
@@ -326,11 +1276,8 @@ namespace gthread {
 
         future& operator=(const future&) = delete;
 
-        // Yields if data has not been set by the corrsponding promise object
-        void wait() const {
-            while (!state.has_data() && !state.has_exception())
-                __impl::kernel_threads.yield_current_green_thread();
-        }
+        // Waits until data has been set by the corrsponding promise object
+        void wait() const { state.wait(); }
 
         void get() const {
             wait();
@@ -339,6 +1286,10 @@ namespace gthread {
                 std::rethrow_exception(state.get_exception());
         }
 
+        // Returns false for a future that has no promise, such as one that
+        // was default constructed or moved from
+        bool valid() const { return state.valid(); }
+
         bool has_data() const { return state.has_data(); }
 
         bool has_exception() const { return state.has_exception(); }
@@ -350,34 +1301,138 @@ namespace gthread {
         std::exception_ptr& exception() { return state.get_exception(); }
 
         operator bool() const { return state.has_data(); }
+
+        // Turns the future into one that can be copied and waited on by any
+        // number of gthreads. The future is no longer valid afterwards
+        shared_future<void> share();
     };
 
-    // A custom version of std::promise
+    // A custom version of std::shared_future. Any number of gthreads may wait
+    // on copies of the same shared_future, and they are all woken together
+    // once the value is set
     template <typename Type>
-    class promise {
+    class shared_future {
     private:
         __impl::shared_state<Type> state;
 
     public:
-        promise() = default;
-        promise(promise&& other) noexcept : state{std::move(other.state)} {}
-        promise(const promise&) = delete;
+        shared_future() = default;
+        shared_future(future<Type>&& other) noexcept
+            : state{std::move(other.state)} {}
 
-        promise& operator=(promise&& other) noexcept {
-            state = std::move(other.state);
-            return *this;
-        }
+        // Waits until data has been set by the corrsponding promise object
+        void wait() const { state.wait(); }
 
-        promise& operator=(const promise) = delete;
+        const Type& get() const {
+            wait();
 
-        void set(Type&& value) { state.set_data(std::move(value)); }
+            if (state.has_exception())
+                std::rethrow_exception(state.get_exception());
 
-        void set(const Type& value) { state.set_data(value); }
+            return state.get_data();
+        }
 
-        void raise(std::exception_ptr e) { state.set_exception(e); }
+        bool valid() const { return state.valid(); }
 
-        future<Type> get_future() const { return future<Type>(state); }
-    };
+        bool has_data() const { return state.has_data(); }
+
+        bool has_exception() const { return state.has_exception(); }
+
+        const std::exception_ptr& exception() const {
+            return state.get_exception();
+        }
+
+        operator bool() const { return state.has_data(); }
+
+        // Two shared_futures are equal when they share the same state
+        friend bool operator==(const shared_future& lhs,
+                               const shared_future& rhs) {
+            return lhs.state == rhs.state;
+        }
+
+        friend bool operator!=(const shared_future& lhs,
+                               const shared_future& rhs) {
+            return lhs.state != rhs.state;
+        }
+    };
+
+    // A custom version of std::shared_future. Any number of gthreads may wait
+    // on copies of the same shared_future, and they are all woken together
+    // once the promise is set
+    template <>
+    class shared_future<void> {
+    private:
+        __impl::shared_state<bool> state;
+
+    public:
+        shared_future() = default;
+        shared_future(future<void>&& other) noexcept
+            : state{std::move(other.state)} {}
+
+        // Waits until data has been set by the corrsponding promise object
+        void wait() const { state.wait(); }
+
+        void get() const {
+            wait();
+
+            if (state.has_exception())
+                std::rethrow_exception(state.get_exception());
+        }
+
+        bool valid() const { return state.valid(); }
+
+        bool has_data() const { return state.has_data(); }
+
+        bool has_exception() const { return state.has_exception(); }
+
+        const std::exception_ptr& exception() const {
+            return state.get_exception();
+        }
+
+        operator bool() const { return state.has_data(); }
+
+        // Two shared_futures are equal when they share the same state
+        friend bool operator==(const shared_future& lhs,
+                               const shared_future& rhs) {
+            return lhs.state == rhs.state;
+        }
+
+        friend bool operator!=(const shared_future& lhs,
+                               const shared_future& rhs) {
+            return lhs.state != rhs.state;
+        }
+    };
+
+    inline shared_future<void> future<void>::share() {
+        return shared_future<void>(std::move(*this));
+    }
+
+    // A custom version of std::promise
+    template <typename Type>
+    class promise {
+    private:
+        __impl::shared_state<Type> state;
+
+    public:
+        promise() : state{__impl::shared_state<Type>::create()} {}
+        promise(promise&& other) noexcept : state{std::move(other.state)} {}
+        promise(const promise&) = delete;
+
+        promise& operator=(promise&& other) noexcept {
+            state = std::move(other.state);
+            return *this;
+        }
+
+        promise& operator=(const promise&) = delete;
+
+        void set(Type&& value) { state.set_data(std::move(value)); }
+
+        void set(const Type& value) { state.set_data(value); }
+
+        void raise(std::exception_ptr e) { state.set_exception(e); }
+
+        future<Type> get_future() const { return future<Type>(state); }
+    };
 
     // A custom version of std::promise
     template <>
@@ -386,7 +1441,7 @@ namespace gthread {
         __impl::shared_state<bool> state;
 
     public:
-        promise() = default;
+        promise() : state{__impl::shared_state<bool>::create()} {}
         promise(promise&& other) noexcept : state{std::move(other.state)} {}
         promise(const promise&) = delete;
 
@@ -395,7 +1450,7 @@ namespace gthread {
             return *this;
         }
 
-        promise& operator=(const promise) = delete;
+        promise& operator=(const promise&) = delete;
 
         void set() { state.set_data(true); }
 
@@ -404,64 +1459,1138 @@ namespace gthread {
         future<void> get_future() const { return future<void>(state); }
     };
 
+    namespace __impl {
+
+        // Runs func and fulfills result with whatever it returns or throws
+        template <typename Value, typename Func>
+        void fulfill(promise<Value>& result, Func& func) {
+            try {
+                if constexpr (std::is_void_v<Value>) {
+                    func();
+                    result.set();
+                } else {
+                    result.set(func());
+                }
+            } catch (...) {
+                result.raise(std::current_exception());
+            }
+        }
+    }  // namespace __impl
+
+    // Collapses concurrent calls for the same key into one. The first gthread
+    // to call run for a key runs func, every other caller gets a copy of its
+    // shared_future until func has returned. Later calls run func again
+    template <typename Key, typename Value, typename Hash = std::hash<Key>>
+    class single_flight {
+    private:
+        std::mutex lock;
+        std::unordered_map<Key, shared_future<Value>, Hash> calls;
+
+    public:
+        template <typename Func>
+        shared_future<Value> run(const Key& key, Func&& func) {
+            promise<Value> result;
+            shared_future<Value> shared;
+
+            {
+                no_preempt preempt_guard;
+                std::unique_lock<std::mutex> guard(lock);
+
+                auto it = calls.find(key);
+
+                if (it != calls.end()) return it->second;
+
+                shared = result.get_future().share();
+                calls.emplace(key, shared);
+            }
+
+            __impl::fulfill(result, func);
+
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            calls.erase(key);
+
+            return shared;
+        }
+
+        // Returns the number of keys that currently have a call running
+        size_t size() {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            return calls.size();
+        }
+    };
+
+    // Caches the result of func for each key. The first gthread to ask for a
+    // key runs func, every other caller, at the same time or later, gets a
+    // copy of the same shared_future. Results that are exceptions are not
+    // kept, so the next call for that key runs func again
+    template <typename Key, typename Value, typename Hash = std::hash<Key>>
+    class memoize {
+    private:
+        std::mutex lock;
+        std::unordered_map<Key, shared_future<Value>, Hash> results;
+
+    public:
+        template <typename Func>
+        shared_future<Value> get(const Key& key, Func&& func) {
+            promise<Value> result;
+            shared_future<Value> shared;
+
+            {
+                no_preempt preempt_guard;
+                std::unique_lock<std::mutex> guard(lock);
+
+                auto it = results.find(key);
+
+                if (it != results.end()) return it->second;
+
+                shared = result.get_future().share();
+                results.emplace(key, shared);
+            }
+
+            __impl::fulfill(result, func);
+
+            if (shared.has_exception()) {
+                no_preempt preempt_guard;
+                std::unique_lock<std::mutex> guard(lock);
+
+                // The key may have been forgotten and computed again while
+                // func was running
+                auto it = results.find(key);
+
+                if (it != results.end() && it->second == shared)
+                    results.erase(it);
+            }
+
+            return shared;
+        }
+
+        // Drops the result for key, the next call for it runs func again.
+        // Gthreads already waiting on the result are not affected
+        void forget(const Key& key) {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            results.erase(key);
+        }
+
+        void clear() {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            results.clear();
+        }
+
+        size_t size() {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            return results.size();
+        }
+    };
+
+    namespace __impl {
+
+        // What func(args...) returns when ran as a task, with func and args
+        // decay-copied and passed as rvalues like std::thread does. Futures
+        // can't hold references, so those are returned as copies
+        template <typename Func, typename... Args>
+        using task_result_t = std::decay_t<
+            std::invoke_result_t<std::decay_t<Func>, std::decay_t<Args>...>>;
+
+        // The frame of a task created by execute or blocking. func and args
+        // are copied or moved into it once, then moved into the call
+        template <typename Func, typename... Args>
+        struct task {
+            using result_type = task_result_t<Func, Args...>;
+
+            std::decay_t<Func> func;
+            std::tuple<std::decay_t<Args>...> args;
+            promise<result_type> result;
+
+            template <typename F, typename... A>
+            task(promise<result_type>&& result, F&& func, A&&... args)
+                : func{std::forward<F>(func)},
+                  args{std::forward<A>(args)...},
+                  result{std::move(result)} {}
+
+            // Calls func and sets the promise. Can only be called once
+            void run() {
+                auto call = [this]() -> result_type {
+                    return std::apply(std::move(func), std::move(args));
+                };
+
+                fulfill(result, call);
+            }
+
+            // Creates a task and returns it along with its future
+            template <typename F, typename... A>
+            static std::pair<task*, future<result_type>> create(F&& func,
+                                                                A&&... args) {
+                auto p = promise<result_type>();
+                auto f = p.get_future();
+
+                auto frame = __impl::create<task>(std::move(p),
+                                                  std::forward<F>(func),
+                                                  std::forward<A>(args)...);
+
+                return {frame, std::move(f)};
+            }
+        };
+
+        // Creates a new gthread on executor on that executes func(args...)
+        // and returns a future. mode decides what happens when the executor
+        // is at one of its limits. If the gthread is refused, the returned
+        // future is not valid
+        template <typename Func, typename... Args>
+        auto spawn(executor& on, spawn_hint hint, admission mode, Func&& func,
+                   Args&&... args) -> future<task_result_t<Func, Args...>> {
+            // Aligned the way create_default does it, so that what is counted
+            // here is what is given back once the gthread stops
+            auto stack_size = (default_stack_size + 15) & ~size_t(15);
+
+            if (!scheduler::admit_green_thread(on, stack_size, mode))
+                return {};
+
+            using Task = task<Func, Args...>;
+
+            auto spawn_address = static_cast<void*>(nullptr);
+
+            if constexpr (std::is_function_v<
+                              std::remove_pointer_t<std::decay_t<Func>>>)
+                spawn_address = reinterpret_cast<void*>(func);
+
+            // Copying the arguments or allocating may throw after the
+            // gthread was counted, and then nothing will ever release it
+            auto [frame, f] = [&] {
+                try {
+                    return Task::create(std::forward<Func>(func),
+                                        std::forward<Args>(args)...);
+                } catch (...) {
+                    scheduler::cancel_green_thread(on, stack_size);
+                    throw;
+                }
+            }();
+
+            auto calling_lambda = +[](void* frame_pointer) {
+                auto frame = static_cast<Task*>(frame_pointer);
+
+                frame->run();
+                __impl::destroy(frame);
+
+                scheduler::exit_current_green_thread();
+            };
+
+            std::shared_ptr<__impl::gthread> thread;
+
+            try {
+                thread = __impl::gthread::create_default(calling_lambda, frame,
+                                                         stack_size);
+            } catch (...) {
+                __impl::destroy(frame);
+                scheduler::cancel_green_thread(on, stack_size);
+                throw;
+            }
+
+            thread->spawn_type = &typeid(std::decay_t<Func>);
+            thread->spawn_address = spawn_address;
+
+            thread->discard = +[](void* frame_pointer) {
+                auto frame = static_cast<Task*>(frame_pointer);
+
+                frame->result.raise(std::make_exception_ptr(
+                    std::future_error(std::future_errc::broken_promise)));
+                __impl::destroy(frame);
+            };
+
+            scheduler::spawn_green_thread(on, thread, hint);
+
+            return std::move(f);
+        }
+
+    }  // namespace __impl
+
+    // Creates a new gthread on executor on that executes func(args...) and
+    // returns a future. The return value of func is used to set the
+    // corrsponding future object. hint controls which kernel thread the
+    // gthread should first run on
+    template <typename Func, typename... Args>
+    auto execute(executor& on, spawn_hint hint, Func&& func, Args&&... args)
+        -> future<__impl::task_result_t<Func, Args...>> {
+        return __impl::spawn(on, hint, __impl::admit_always,
+                             std::forward<Func>(func),
+                             std::forward<Args>(args)...);
+    }
+
+    // Creates a new gthread on executor on that executes func(args...) and
+    // returns a future. The return value of func is used to set the
+    // corrsponding future object
+    template <typename Func, typename... Args>
+    auto execute(executor& on, Func&& func, Args&&... args)
+        -> future<__impl::task_result_t<Func, Args...>> {
+        return execute(on, any_worker, std::forward<Func>(func),
+                       std::forward<Args>(args)...);
+    }
+
     // Creates a new gthread that executes func(args...) and returns a future.
-    // The return value of func is used to set the corrsponding future object
+    // The return value of func is used to set the corrsponding future object.
+    // hint controls which kernel thread the gthread should first run on. The
+    // gthread is queued on the executor of the calling gthread, or the
+    // default executor outside of a gthread
+    template <typename Func, typename... Args>
+    auto execute(spawn_hint hint, Func&& func, Args&&... args)
+        -> future<__impl::task_result_t<Func, Args...>> {
+        return execute(executor::current(), hint, std::forward<Func>(func),
+                       std::forward<Args>(args)...);
+    }
+
+    // Creates a new gthread that executes func(args...) and returns a future.
+    // The return value of func is used to set the corrsponding future object.
+    // The gthread is queued on the executor of the calling gthread, or the
+    // default executor outside of a gthread
     template <typename Func, typename... Args>
     auto execute(Func&& func, Args&&... args)
-        -> future<decltype(func(args...))> {
-        using RetType = decltype(func(args...));
-        using BindingType = decltype(std::bind(func, args...));
+        -> future<__impl::task_result_t<Func, Args...>> {
+        return execute(executor::current(), any_worker,
+                       std::forward<Func>(func), std::forward<Args>(args)...);
+    }
+
+    // Creates a new gthread on executor on like execute, unless that would
+    // go over one of the executor's limits, in which case nothing is created
+    // and std::nullopt is returned. Callers can use this to shed load
+    template <typename Func, typename... Args>
+    auto try_execute(executor& on, Func&& func, Args&&... args)
+        -> std::optional<future<__impl::task_result_t<Func, Args...>>> {
+        auto f = __impl::spawn(on, any_worker, __impl::admit_if_room,
+                               std::forward<Func>(func),
+                               std::forward<Args>(args)...);
+
+        if (!f.valid()) return std::nullopt;
+
+        return f;
+    }
 
-        using UserParams = std::tuple<BindingType, promise<RetType>>;
+    // Creates a new gthread like execute, unless that would go over one of
+    // the limits of the executor of the calling gthread, or the default
+    // executor outside of a gthread. Returns std::nullopt if nothing was
+    // created
+    template <typename Func, typename... Args>
+    auto try_execute(Func&& func, Args&&... args)
+        -> std::optional<future<__impl::task_result_t<Func, Args...>>> {
+        return try_execute(executor::current(), std::forward<Func>(func),
+                           std::forward<Args>(args)...);
+    }
 
-        auto p = promise<RetType>();
-        auto f = p.get_future();
+    // Creates a new gthread on executor on like execute, but first waits
+    // until the executor's limits leave room for it. The calling gthread is
+    // parked while it waits, outside of a gthread the scheduler is ran
+    template <typename Func, typename... Args>
+    auto execute(executor& on, wait_for_capacity_t, Func&& func,
+                 Args&&... args)
+        -> future<__impl::task_result_t<Func, Args...>> {
+        return __impl::spawn(on, any_worker, __impl::admit_when_room,
+                             std::forward<Func>(func),
+                             std::forward<Args>(args)...);
+    }
 
-        auto user_params =
-            new UserParams{std::bind(func, args...), std::move(p)};
+    // Creates a new gthread like execute, but first waits until the limits
+    // of the executor of the calling gthread, or the default executor
+    // outside of a gthread, leave room for it
+    template <typename Func, typename... Args>
+    auto execute(wait_for_capacity_t, Func&& func, Args&&... args)
+        -> future<__impl::task_result_t<Func, Args...>> {
+        return execute(executor::current(), wait_for_capacity,
+                       std::forward<Func>(func), std::forward<Args>(args)...);
+    }
 
-        auto calling_lambda = +[](void* params_pointer) {
-            auto user_params = static_cast<UserParams*>(params_pointer);
+    // Runs func(args...) on a kernel thread outside of the scheduler and
+    // returns a future. Use this for calls that block the kernel thread, such
+    // as blocking I/O, so that the kernel threads running gthreads stay
+    // available. Waiting on the future parks the calling gthread until func
+    // returns
+    template <typename Func, typename... Args>
+    auto blocking(Func&& func, Args&&... args)
+        -> future<__impl::task_result_t<Func, Args...>> {
+        using Task = __impl::task<Func, Args...>;
 
-            auto& [b, p] = *user_params;
+        auto [frame, f] =
+            Task::create(std::forward<Func>(func), std::forward<Args>(args)...);
 
-            try {
-                if constexpr (std::is_same_v<RetType, void>) {
-                    b();
-                    p.set();
-                } else {
-                    p.set(b());
+        auto calling_lambda = +[](void* frame_pointer) {
+            auto frame = static_cast<Task*>(frame_pointer);
+
+            frame->run();
+            __impl::destroy(frame);
+        };
+
+        __impl::blocking_threads.submit(calling_lambda, frame);
+
+        return std::move(f);
+    }
+
+    // Thrown to whoever asked an actor for a reply when the actor stopped
+    // without replying
+    class actor_error : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+    };
+
+    // The reply to an actor request. It sets the future returned by
+    // actor::ask. If it is destroyed without a reply being set, such as when
+    // the actor fails or is stopped before handling the request, the future
+    // gets an actor_error instead
+    template <typename Type>
+    class reply {
+    private:
+        promise<Type> p;
+        bool pending = true;
+
+    public:
+        explicit reply(promise<Type>&& p) : p{std::move(p)} {}
+
+        reply(reply&& other) noexcept
+            : p{std::move(other.p)}, pending{other.pending} {
+            other.pending = false;
+        }
+
+        reply(const reply&) = delete;
+        reply& operator=(const reply&) = delete;
+
+        ~reply() {
+            if (pending)
+                p.raise(std::make_exception_ptr(
+                    actor_error("The actor stopped without replying")));
+        }
+
+        // Sets the reply. Only the first reply or exception is used
+        template <typename... Args>
+        void set(Args&&... args) {
+            if (!pending) return;
+
+            pending = false;
+            p.set(std::forward<Args>(args)...);
+        }
+
+        void raise(std::exception_ptr e) {
+            if (!pending) return;
+
+            pending = false;
+            p.raise(e);
+        }
+    };
+
+    template <typename Msg>
+    class actor;
+
+    namespace __impl {
+
+        // The part of an actor that doesn't depend on the message type, so
+        // that actors of different types can be linked together
+        class actor_core : public std::enable_shared_from_this<actor_core> {
+        private:
+            std::mutex lock;
+            std::vector<std::weak_ptr<actor_core>> links;
+            std::exception_ptr failure;
+            std::function<void(std::exception_ptr)> link_failure_handler;
+
+        protected:
+            // Set once the actor has failed or been stopped. Messages are
+            // discarded from then on
+            std::atomic<bool> stopped = false;
+
+            // Queues the failure of a linked actor in the mailbox
+            virtual void post_failure(std::exception_ptr e) = 0;
+
+            // Makes sure a gthread will drain the mailbox
+            virtual void schedule() = 0;
+
+            // Stops the actor because of e and passes e on to linked actors
+            void fail(std::exception_ptr e);
+
+            // Handles the failure of a linked actor. Unless a handler was
+            // given to on_link_failure, the actor fails as well
+            void handle_link_failure(std::exception_ptr e);
+
+        public:
+            virtual ~actor_core() = default;
+
+            // Links two actors, so that when either fails the other is told
+            // about it. Linking to an actor that already failed reports the
+            // failure right away
+            static void link(const std::shared_ptr<actor_core>& lhs,
+                             const std::shared_ptr<actor_core>& rhs);
+
+            void on_link_failure(
+                std::function<void(std::exception_ptr)> handler);
+
+            // Stops the actor without failing linked actors
+            void stop();
+
+            bool is_stopped() const { return stopped.load(); }
+
+            std::exception_ptr get_failure();
+        };
+
+        // An actor's mailbox and handler. The mailbox is an intrusive
+        // multiple producer single consumer queue, see
+        // https://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+        template <typename Msg>
+        class actor_state final : public actor_core {
+            friend class ::gthread::actor<Msg>;
+
+        private:
+            struct node {
+                std::atomic<node*> next = nullptr;
+
+                // Either a message or the failure of a linked actor
+                std::optional<Msg> message;
+                std::exception_ptr failure;
+            };
+
+            std::atomic<node*> head;
+            node* tail;
+            node stub;
+
+            // Set while a gthread is draining the mailbox, so that only one
+            // gthread ever handles the actor's messages
+            std::atomic<bool> scheduled = false;
+
+            std::function<void(Msg&)> handler;
+            executor* on;
+            size_t batch;
+
+            void push(node* n) {
+                n->next.store(nullptr, std::memory_order_relaxed);
+
+                auto previous = head.exchange(n);
+                previous->next.store(n, std::memory_order_release);
+            }
+
+            // Returns nullptr if the mailbox is empty, or a message is still
+            // being pushed
+            node* pop() {
+                auto first = tail;
+                auto next = first->next.load(std::memory_order_acquire);
+
+                if (first == &stub) {
+                    if (!next) return nullptr;
+
+                    tail = next;
+                    first = next;
+                    next = next->next.load(std::memory_order_acquire);
                 }
-            } catch (...) {
-                p.raise(std::current_exception());
+
+                if (next) {
+                    tail = next;
+                    return first;
+                }
+
+                if (first != head.load()) return nullptr;
+
+                push(&stub);
+
+                next = first->next.load(std::memory_order_acquire);
+
+                if (next) {
+                    tail = next;
+                    return first;
+                }
+
+                return nullptr;
+            }
+
+            bool has_messages() {
+                return head.load() != tail ||
+                       tail->next.load(std::memory_order_acquire);
             }
 
-            delete user_params;
+            void handle(node* n) {
+                if (!stopped.load()) {
+                    if (!n->message)
+                        handle_link_failure(n->failure);
+
+                    else {
+                        try {
+                            handler(*n->message);
+                        } catch (...) {
+                            fail(std::current_exception());
+                        }
+                    }
+                }
+
+                destroy(n);
+            }
+
+            // Handles messages until the mailbox is empty, yielding after
+            // every batch messages
+            void drain() {
+                while (true) {
+                    size_t count = 0;
+
+                    while (count < batch) {
+                        auto n = pop();
+                        if (!n) break;
+
+                        handle(n);
+                        count++;
+                    }
+
+                    if (count == batch) {
+                        scheduler::yield_current_green_thread();
+                        continue;
+                    }
+
+                    // A sender that pushes after this sees scheduled cleared
+                    // and creates a new gthread, otherwise the message is
+                    // seen here
+                    scheduled.store(false);
+
+                    if (!has_messages() || scheduled.exchange(true)) return;
 
-            __impl::kernel_threads.exit_current_green_thread();
+                    // A message is still being pushed
+                    if (count == 0) scheduler::yield_current_green_thread();
+                }
+            }
+
+            static void run(std::shared_ptr<actor_state> self) {
+                self->drain();
+            }
+
+            void schedule() override {
+                if (scheduled.exchange(true)) return;
+
+                // A sender rarely waits on the actor right away, so the
+                // messages are handled by whichever kernel thread is free
+                execute(*on, any_worker, run,
+                        std::static_pointer_cast<actor_state>(
+                            shared_from_this()));
+            }
+
+            void post_failure(std::exception_ptr e) override {
+                if (stopped.load()) return;
+
+                no_preempt guard;
+
+                auto n = create<node>();
+                n->failure = std::move(e);
+
+                push(n);
+                schedule();
+            }
+
+        public:
+            template <typename Handler>
+            actor_state(Handler&& handler, executor& on, size_t batch)
+                : head{&stub},
+                  tail{&stub},
+                  handler{std::forward<Handler>(handler)},
+                  on{&on},
+                  batch{batch > 0 ? batch : 1} {}
+
+            ~actor_state() {
+                while (auto n = pop()) destroy(n);
+            }
+
+            bool send(Msg&& message) {
+                if (stopped.load()) return false;
+
+                no_preempt guard;
+
+                auto n = create<node>();
+                n->message.emplace(std::move(message));
+
+                push(n);
+                schedule();
+
+                return true;
+            }
         };
 
-        auto thread = __impl::gthread::create_default(
-            calling_lambda, user_params, default_stack_size);
+    }  // namespace __impl
 
-        __impl::kernel_threads.lock.lock();
-        __impl::kernel_threads.green_threads.push_back(thread);
-        __impl::kernel_threads.lock.unlock();
+    // An actor handles messages of type Msg one at a time, in the order they
+    // were sent. It only takes up a gthread while it has messages to handle,
+    // and gives the kernel thread to other gthreads after every batch
+    // messages. If the handler throws, the actor fails: its remaining
+    // messages are discarded and linked actors are told about the failure.
+    // Copies of an actor refer to the same actor
+    template <typename Msg>
+    class actor {
+        template <typename Other>
+        friend class actor;
 
-        return f;
+    private:
+        std::shared_ptr<__impl::actor_state<Msg>> state;
+
+    public:
+        // Creates an empty actor that can't be sent messages
+        actor() = default;
+
+        // Creates an actor whose messages are handled by handler(Msg&) on
+        // gthreads of executor on
+        template <typename Handler>
+        explicit actor(Handler&& handler, executor& on = executor::current(),
+                       size_t batch = default_actor_batch)
+            : state{std::allocate_shared<__impl::actor_state<Msg>>(
+                  allocator<__impl::actor_state<Msg>>(),
+                  std::forward<Handler>(handler), on, batch)} {}
+
+        // Sends message to the actor. Returns false if the actor has failed
+        // or been stopped, in which case message is discarded
+        bool send(Msg message) const { return state->send(std::move(message)); }
+
+        // Sends the message returned by make(reply<Reply>) and returns a
+        // future for the reply. The handler answers by calling set on the
+        // reply it was given
+        template <typename Reply, typename Make>
+        future<Reply> ask(Make&& make) const {
+            promise<Reply> p;
+            auto f = p.get_future();
+
+            send(std::forward<Make>(make)(reply<Reply>(std::move(p))));
+
+            return f;
+        }
+
+        // Links this actor to other, so that when either fails the other
+        // fails too, unless it handles the failure with on_link_failure
+        template <typename Other>
+        void link(const actor<Other>& other) const {
+            __impl::actor_core::link(state, other.state);
+        }
+
+        // Handles the failures of linked actors with handler instead of
+        // failing. It runs on the actor's gthread between messages, so an
+        // actor supervising others can restart them from it. If handler
+        // throws, the actor fails
+        void on_link_failure(
+            std::function<void(std::exception_ptr)> handler) const {
+            state->on_link_failure(std::move(handler));
+        }
+
+        // Stops the actor. Messages that have not been handled yet are
+        // discarded, and linked actors are not told
+        void stop() const { state->stop(); }
+
+        // Returns true if the actor has failed or been stopped
+        bool stopped() const { return state->is_stopped(); }
+
+        // Returns why the actor failed, or nullptr if it hasn't
+        std::exception_ptr failure() const { return state->get_failure(); }
+
+        explicit operator bool() const { return state != nullptr; }
+
+        friend bool operator==(const actor& lhs, const actor& rhs) {
+            return lhs.state == rhs.state;
+        }
+
+        friend bool operator!=(const actor& lhs, const actor& rhs) {
+            return lhs.state != rhs.state;
+        }
+    };
+
+    // A graph of work whose nodes and edges are declared up front. Running the
+    // graph runs every node once all of the nodes before it have finished,
+    // on gthreads of an executor. No gthread ever waits on another node, a
+    // node that finishes goes on to run one of the nodes it made ready and
+    // creates gthreads for the rest. A graph can be ran again once the
+    // previous run is done, which reuses everything allocated by the last
+    // run. The graph must not be changed or destroyed while it runs
+    class graph {
+    public:
+        // A node of a graph. It stays valid until the graph is cleared
+        class node {
+            friend class graph;
+
+        private:
+            graph* owner = nullptr;
+            uint32_t index = 0;
+
+            node(graph* owner, uint32_t index) : owner{owner}, index{index} {}
+
+        public:
+            node() = default;
+
+            // Makes other run after this node
+            node& precede(node other);
+
+            // Makes this node run after other
+            node& succeed(node other);
+        };
+
+    private:
+        enum node_kind : uint8_t { work_node, condition_node, subgraph_node };
+
+        struct node_data {
+            graph* owner;
+            node_kind kind;
+
+            // Set when the node has a condition node before it. Such a node
+            // is only ran when a condition picks it
+            bool conditional = false;
+
+            // How many non condition nodes must finish before the node runs
+            uint32_t predecessors = 0;
+
+            // The node's successors in successors
+            uint32_t successors_begin = 0;
+            uint32_t successors_end = 0;
+
+            std::function<void()> work;
+            std::function<size_t()> condition;
+            graph* subgraph = nullptr;
+        };
+
+        using completion = void (*)(void*, std::exception_ptr);
+
+        static constexpr uint32_t no_node = UINT32_MAX;
+
+        std::vector<node_data> nodes;
+        std::vector<std::pair<uint32_t, uint32_t>> edges;
+
+        // The successors of every node, grouped by node. This and the
+        // predecessor counts are rebuilt before a run when edges changed
+        std::vector<uint32_t> successors;
+        bool edges_changed = false;
+
+        std::unique_ptr<std::atomic<uint32_t>[]> counters;
+        size_t counter_count = 0;
+
+        // The state of the current run
+        std::atomic<bool> running = false;
+        executor* on = nullptr;
+        std::atomic<size_t> active = 0;
+        std::atomic<bool> failed = false;
+        std::exception_ptr error;
+        completion done = nullptr;
+        void* done_arg = nullptr;
+        promise<void> finished;
+
+        node add(node_data&& data);
+
+        // Sorts edges into successors and counts the predecessors of every
+        // node
+        void build();
+
+        // Starts a run. done(done_arg, error) is called once every node has
+        // finished, or right away if there is nothing to run. Without done,
+        // result is set instead
+        void start(executor& on, completion done, void* done_arg,
+                   promise<void>* result = nullptr);
+
+        // Runs nodes starting with index until no node is left that this
+        // gthread can run
+        void run_from(uint32_t index);
+
+        // Marks the node as finished. Returns the next node the caller
+        // should run, or no_node
+        uint32_t finish(uint32_t index, size_t chosen);
+
+        void complete();
+
+        static void run_node(graph* self, uint32_t index);
+        static void subgraph_done(void* arg, std::exception_ptr e);
+
+    public:
+        graph() = default;
+
+        graph(const graph&) = delete;
+        graph& operator=(const graph&) = delete;
+
+        // Adds a node that calls work()
+        node emplace(std::function<void()> work);
+
+        // Adds a node that calls condition() and then runs only the
+        // successor at the index it returns, in the order they were added.
+        // Edges from a condition node don't count as dependencies, so a
+        // condition may pick a node that already ran to form a loop
+        node emplace_condition(std::function<size_t()> condition);
+
+        // Adds a node that runs all of sub. The node finishes once every
+        // node of sub has. sub must not run anywhere else at the same time
+        node emplace_subgraph(graph& sub);
+
+        // Removes every node and edge. The graph must not be running
+        void clear();
+
+        size_t size() const { return nodes.size(); }
+
+        // Runs the graph on gthreads of executor on. The future is set once
+        // every node has finished. If a node throws, nodes that have not
+        // started yet are skipped and the future gets the exception. If the
+        // graph is already running, an exception is thrown
+        future<void> run(executor& on = executor::current());
+    };
+
+    // How a pipeline stage may run. serial_in_order runs one token at a time
+    // in the order the tokens were read, serial_out_of_order runs one token
+    // at a time in any order, and parallel runs any number of tokens at once
+    enum stage_mode { serial_in_order, serial_out_of_order, parallel };
+
+    namespace __impl {
+
+        // Lets one token at a time through a serial pipeline stage. Tokens
+        // waiting for the gate are parked, and the token leaving the gate
+        // hands it to the next one
+        class pipeline_gate {
+        private:
+            std::mutex lock;
+            bool in_order = false;
+            bool busy = false;
+            uint64_t next = 0;
+            std::vector<std::pair<uint64_t, std::shared_ptr<gthread>>> waiting;
+
+        public:
+            explicit pipeline_gate(bool in_order) : in_order{in_order} {}
+
+            // Prepares the gate for a new run
+            void reset();
+
+            // Waits until the token with sequence may pass. This must be
+            // called from a gthread
+            void enter(uint64_t sequence);
+
+            // Lets the next token through
+            void leave();
+        };
+
+    }  // namespace __impl
+
+    // Runs tokens through a series of stages, such as read, parse, transform
+    // and write. The input function fills in a token and returns false once
+    // there is no more input, then every stage is called on the token in
+    // turn. At most max_tokens tokens are in flight, each carried through all
+    // of the stages by its own gthread, so memory stays bounded no matter how
+    // much input there is. Tokens are reused, so Token can hold buffers that
+    // are kept between items. The pipeline must not be changed or destroyed
+    // while it runs
+    template <typename Token>
+    class pipeline {
+    private:
+        struct stage_data {
+            std::function<void(Token&)> function;
+            std::unique_ptr<__impl::pipeline_gate> gate;
+        };
+
+        std::function<bool(Token&)> input;
+        __impl::pipeline_gate input_gate{false};
+        std::vector<stage_data> stages;
+
+        // The state of the current run. input_done and next_sequence are
+        // guarded by input_gate
+        std::atomic<bool> running = false;
+        bool input_done = false;
+        uint64_t next_sequence = 0;
+        std::atomic<size_t> live = 0;
+        std::atomic<bool> failed = false;
+        std::exception_ptr error;
+        promise<void> finished;
+
+        void fail(std::exception_ptr e) {
+            if (!failed.exchange(true)) error = std::move(e);
+        }
+
+        // Reads the next token. Returns false once the input is done or a
+        // stage has failed
+        bool read(Token& token, uint64_t& sequence) {
+            input_gate.enter(0);
+
+            auto has_token = false;
+
+            if (!input_done && !failed.load()) {
+                sequence = next_sequence++;
+
+                try {
+                    has_token = input(token);
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+
+                if (!has_token) input_done = true;
+            }
+
+            input_gate.leave();
+
+            return has_token;
+        }
+
+        void run_tokens() {
+            Token token{};
+            uint64_t sequence = 0;
+
+            while (read(token, sequence)) {
+                // A token read before a failure still passes through the
+                // serial stages, so the tokens after it aren't held up
+                for (auto& stage : stages) {
+                    if (stage.gate) stage.gate->enter(sequence);
+
+                    if (!failed.load()) {
+                        try {
+                            stage.function(token);
+                        } catch (...) {
+                            fail(std::current_exception());
+                        }
+                    }
+
+                    if (stage.gate) stage.gate->leave();
+                }
+            }
+
+            if (live.fetch_sub(1) == 1) complete();
+        }
+
+        void complete() {
+            auto result = std::move(finished);
+            auto e = std::move(error);
+
+            // The pipeline may be ran again as soon as the future is set
+            running.store(false);
+
+            if (e)
+                result.raise(std::move(e));
+            else
+                result.set();
+        }
+
+        static void token_runner(pipeline* self) { self->run_tokens(); }
+
+    public:
+        // Creates a pipeline that reads tokens with input
+        explicit pipeline(std::function<bool(Token&)> input)
+            : input{std::move(input)} {}
+
+        pipeline(const pipeline&) = delete;
+        pipeline& operator=(const pipeline&) = delete;
+
+        // Adds a stage that calls function on every token
+        pipeline& stage(stage_mode mode, std::function<void(Token&)> function) {
+            std::unique_ptr<__impl::pipeline_gate> gate;
+
+            if (mode != parallel)
+                gate = std::make_unique<__impl::pipeline_gate>(
+                    mode == serial_in_order);
+
+            stages.push_back({std::move(function), std::move(gate)});
+
+            return *this;
+        }
+
+        // Runs the pipeline on gthreads of executor on with at most
+        // max_tokens tokens in flight. The future is set once all of the
+        // input has been through every stage. If a stage throws, no more
+        // input is read and the future gets the exception. If the pipeline
+        // is already running, an exception is thrown
+        future<void> run(size_t max_tokens,
+                         executor& on = executor::current()) {
+            if (running.exchange(true))
+                throw std::runtime_error(
+                    "Cannot run a pipeline that is running");
+
+            if (max_tokens == 0) max_tokens = 1;
+
+            finished = promise<void>();
+            auto f = finished.get_future();
+
+            input_gate.reset();
+            for (auto& stage : stages)
+                if (stage.gate) stage.gate->reset();
+
+            input_done = false;
+            next_sequence = 0;
+            failed.store(false);
+            error = nullptr;
+
+            // Count every gthread before any of them runs, so that the run
+            // can't complete while they are still being created
+            live.store(max_tokens);
+
+            for (size_t i = 0; i < max_tokens; i++)
+                execute(on, any_worker, token_runner, this);
+
+            return f;
+        }
+    };
+
+    // Returns the default executor, which runs gthreads created outside of any
+    // other executor
+    inline executor& default_executor() { return __impl::kernel_threads; }
+
+    // Enables preemption on the default executor. A gthread that runs for
+    // longer than roughly slice without yielding is switched out and put at
+    // the back of the queue. Only code in the main executable is preempted,
+    // calls into shared libraries are allowed to finish first, and code inside
+    // a no_preempt guard is never preempted. Preemption is only supported on
+    // Linux, elsewhere this throws
+    inline void enable_preemption(
+        std::chrono::microseconds slice = std::chrono::milliseconds(10)) {
+        __impl::kernel_threads.enable_preemption(slice);
+    }
+
+    // Disables preemption on the default executor
+    inline void disable_preemption() {
+        __impl::kernel_threads.disable_preemption();
     }
 
+    // Sets the limits of the default executor, see admission_limits
+    inline void set_limits(const admission_limits& limits) {
+        __impl::kernel_threads.set_limits(limits);
+    }
+
+    // Returns the load on the default executor
+    inline admission_metrics metrics() {
+        return __impl::kernel_threads.metrics();
+    }
+
+    // A sampling CPU profiler. Samples are attributed to the gthread running
+    // at the time, by the function it was created to run, and include a stack
+    // walked within the gthread's own stack. Stack walking relies on frame
+    // pointers, so build with -fno-omit-frame-pointer for full stacks, and link
+    // with -rdynamic for function names. Only supported on Linux, elsewhere
+    // start throws
+    namespace profiler {
+
+        // Starts taking frequency samples per second of CPU time. At most
+        // max_samples are kept, later samples are counted as dropped
+        void start(unsigned frequency = 99, size_t max_samples = 16384);
+
+        // Stops taking samples. Samples taken so far are kept
+        void stop();
+
+        // Stops taking samples and writes the samples taken as folded
+        // stacks, one line per unique stack, which can be turned into a flame
+        // graph. Each stack starts with the function its gthread was created
+        // to run, or [scheduler] and [kernel thread] for time spent outside
+        // of gthreads
+        void write_folded(std::ostream& out);
+
+        // Stops taking samples and discards all samples taken
+        void clear();
+
+        // Returns how many samples did not fit
+        size_t dropped();
+
+        // Profiles all gthreads for duration and writes the result as folded
+        // stacks. The calling gthread is parked until duration has passed. A
+        // kernel thread running a scheduler runs gthreads in the meantime
+        void profile_for(std::chrono::nanoseconds duration, std::ostream& out,
+                         unsigned frequency = 99);
+
+    }  // namespace profiler
+
     // Yields the current gthread. If this is called without a current
     // gthread, the scheduler is ran
-    inline void yield() { __impl::kernel_threads.yield_current_green_thread(); }
+    inline void yield() { __impl::scheduler::yield_current_green_thread(); }
 
     // Exits the current gthread. If this is called without a current
     // gthread, an exception is thrown
-    inline void exit() { __impl::kernel_threads.exit_current_green_thread(); }
+    inline void exit() { __impl::scheduler::exit_current_green_thread(); }
 
     // Runs all the green threads, only returning when all are processed
     inline void process_all_gthreads() {
-        __impl::kernel_threads.process_green_threads();
+        __impl::kernel_threads.run_until_idle();
     }
 
 }  // namespace gthread
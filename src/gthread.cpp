@@ -1,7 +1,18 @@
+#include <algorithm>
 #include <atomic>
 #include <gthread.hpp>
 #include <iostream>
 #include <stdexcept>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <ucontext.h>
+
+#include <cerrno>
+#endif
 
 #include "gthread_sysv_x86_64.hpp"
 #include "gthread_win_x86_64.hpp"
@@ -9,21 +20,115 @@
 
 namespace gthread::__impl {
 
+    namespace {
+
+        // The context of the calling kernel thread. This is used instead of
+        // looking up contexts where a lookup is not async signal safe
+        thread_local context* kernel_thread_context = nullptr;
+
+        // Set while a no_preempt guard looks up the running gthread. Until the
+        // guard has marked it, a preemption could move it to another kernel
+        // thread and leave it with this kernel thread's context, so the
+        // preemption handler only marks it as pending instead
+        thread_local volatile sig_atomic_t entering_no_preempt = 0;
+
+#ifdef __linux__
+        // The signal sent by the preemption monitor. SIGURG is ignored by
+        // default, so a stray signal does no harm
+        constexpr int preemption_signal = SIGURG;
+
+        // The address ranges of the main executable's code. Only code in these
+        // ranges is preempted, as shared libraries such as libc hold locks and
+        // per kernel thread state that must not be switched away from
+        constexpr size_t max_code_ranges = 8;
+        uintptr_t code_range_begin[max_code_ranges];
+        uintptr_t code_range_end[max_code_ranges];
+        size_t code_range_count = 0;
+
+        int find_code_ranges(dl_phdr_info* info, size_t, void*) {
+            for (size_t i = 0; i < info->dlpi_phnum; i++) {
+                auto& header = info->dlpi_phdr[i];
+
+                if (header.p_type != PT_LOAD || !(header.p_flags & PF_X))
+                    continue;
+
+                if (code_range_count == max_code_ranges) break;
+
+                auto begin = info->dlpi_addr + header.p_vaddr;
+                code_range_begin[code_range_count] = begin;
+                code_range_end[code_range_count] = begin + header.p_memsz;
+                code_range_count++;
+            }
+
+            // The main executable is always reported first
+            return 1;
+        }
+
+        bool in_main_executable(void* ucontext) {
+            auto& mcontext = static_cast<ucontext_t*>(ucontext)->uc_mcontext;
+#ifdef __x86_64__
+            auto pc = static_cast<uintptr_t>(mcontext.gregs[REG_RIP]);
+#else
+            auto pc = static_cast<uintptr_t>(mcontext.gregs[REG_EIP]);
+#endif
+
+            for (size_t i = 0; i < code_range_count; i++) {
+                if (pc >= code_range_begin[i] && pc < code_range_end[i])
+                    return true;
+            }
+
+            return false;
+        }
+
+        // errno lives in the kernel thread, and the compiler may look up its
+        // address once per function. Setting it from a separate function
+        // looks it up again, after a preempted gthread may have moved to
+        // another kernel thread
+        __attribute__((noinline)) void restore_errno(int value) {
+            errno = value;
+        }
+
+        void preemption_handler(int, siginfo_t*, void* ucontext) {
+            auto saved_errno = errno;
+
+            auto ctx = kernel_thread_context;
+            auto thread = ctx ? ctx->running.load() : nullptr;
+
+            if (thread) {
+                if (thread->preemptible && !entering_no_preempt &&
+                    in_main_executable(ucontext))
+                    // Returns once the gthread is scheduled again, possibly on
+                    // another kernel thread. The signal return then restores
+                    // the rest of the interrupted state
+                    thread->swap(ctx->scheduling);
+
+                else
+                    thread->preempt_pending = 1;
+            }
+
+            restore_errno(saved_errno);
+        }
+#endif
+
+    }  // namespace
+
     std::shared_ptr<gthread> gthread::create_default(Function function,
                                                      void* user_params,
                                                      size_t stack_size) {
         stack_size = (stack_size + 15) & ~15;
 #ifdef __x86_64__
 #ifdef _WIN32
-        return std::make_shared<win_x86_64_gthread>(function, user_params,
-                                                    stack_size, false);
+        return std::allocate_shared<win_x86_64_gthread>(
+            allocator<win_x86_64_gthread>(), function, user_params, stack_size,
+            false);
 #elif defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
-        return std::make_shared<sysv_x86_64_gthread>(function, user_params,
-                                                     stack_size, false);
+        return std::allocate_shared<sysv_x86_64_gthread>(
+            allocator<sysv_x86_64_gthread>(), function, user_params,
+            stack_size, false);
 #endif
 #elif __i386__
-        return std::make_shared<x86_gthread>(function, user_params, stack_size,
-                                             false);
+        return std::allocate_shared<x86_gthread>(
+            allocator<x86_gthread>(), function, user_params, stack_size, false);
 #endif
     }
 
@@ -39,119 +144,1057 @@ namespace gthread::__impl {
 #elif __i386__
         auto gthread = std::make_shared<x86_gthread>(nullptr, nullptr, 0, true);
 #endif
+        // The scheduler is never preempted
+        gthread->no_preempt_depth = 1;
+
         gthread->swap(gthread);
         return gthread;
     }
 
-    void kernel_threads_manager::setup_kernel_thread_context() {
+}  // namespace gthread::__impl
+
+namespace gthread {
+
+    using __impl::context;
+    using __impl::gthread;
+
+    context& executor::setup_kernel_thread_context() {
+        std::unique_lock<std::mutex> guard(lock);
+
+        auto it = contexts.find(std::this_thread::get_id());
+
+        if (it != contexts.end()) return it->second;
+
+        guard.unlock();
+
         auto scheduling = gthread::create_scheduling();
+
+        guard.lock();
+        auto& ctx = contexts[std::this_thread::get_id()];
+        ctx = {scheduling, this};
+        guard.unlock();
+
+#ifdef __linux__
+        preemption_lock.lock();
+        kernel_thread_handles.emplace_back(&ctx, pthread_self());
+        preemption_lock.unlock();
+#endif
+
+        return ctx;
+    }
+
+    void executor::remove_kernel_thread_context() {
+        auto ctx = __impl::kernel_thread_context;
+
+        __impl::kernel_thread_context = nullptr;
+
+#ifdef __linux__
+        // The preemption monitor must not signal a kernel thread that has
+        // exited. It never takes lock, so this can be locked while holding it
+        preemption_lock.lock();
+        kernel_thread_handles.remove_if(
+            [&](auto& entry) { return entry.first == ctx; });
+        preemption_lock.unlock();
+#endif
+
+        release_spare_stacks(*ctx);
+
+        contexts.erase(std::this_thread::get_id());
+    }
+
+    executor& executor::current() {
+        auto ctx = __impl::kernel_thread_context;
+
+        if (!ctx) return __impl::kernel_threads;
+
+        return *ctx->owner;
+    }
+
+    context* executor::find_kernel_thread_context() {
+        return __impl::kernel_thread_context;
+    }
+
+    std::shared_ptr<gthread> executor::current_green_thread() {
+        auto ctx = find_kernel_thread_context();
+
+        if (!ctx) return nullptr;
+
+        return ctx->current;
+    }
+
+    void executor::spawn_green_thread(std::shared_ptr<gthread> thread,
+                                      spawn_hint hint) {
+        // Taken first, so that ctx stays the context of the kernel thread
+        // running this code
+        ::gthread::no_preempt guard;
+
+        auto ctx = find_kernel_thread_context();
+
+        thread->owner = this;
+
+        // The "run next" slot is only drained by the scheduler, so only use it
+        // when the caller is a gthread that will return to this executor's
+        // scheduler
+        if (hint == same_worker && ctx && ctx->current && ctx->owner == this) {
+            ctx->next_lock.lock();
+            std::swap(ctx->next, thread);
+            ctx->next_lock.unlock();
+
+            if (!thread) {
+                // Pairs with an idle kernel thread counting itself before it
+                // looks at the slot, so that one of the two sees the other
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                if (idle_workers.load() > 0) {
+                    lock.lock();
+                    work_available.notify_one();
+                    lock.unlock();
+                }
+
+                return;
+            }
+        }
+
         lock.lock();
-        contexts[std::this_thread::get_id()] = {scheduling};
+        green_threads.push_back(thread);
+        notify_worker();
         lock.unlock();
     }
 
-    void kernel_threads_manager::process_green_threads() {
-        auto& ctx = contexts[std::this_thread::get_id()];
+    void executor::set_limits(const admission_limits& new_limits) {
+        max_live = new_limits.max_live;
+        max_queued = new_limits.max_queued;
+        max_stack_bytes = new_limits.max_stack_bytes;
 
-        while (true) {
-            lock.lock();
+        // Start counting against the new limits without stacks kept from
+        // before
+        release_spare_stacks();
+    }
 
-            if (green_threads.empty()) {
-                lock.unlock();
+    admission_limits executor::limits() const {
+        admission_limits result;
+        result.max_live = max_live.load();
+        result.max_queued = max_queued.load();
+        result.max_stack_bytes = max_stack_bytes.load();
+        return result;
+    }
+
+    admission_metrics executor::metrics() const {
+        admission_metrics result;
+        result.live = live_count.load();
+        result.queued = queued_count.load();
+        result.stack_bytes = stack_bytes.load();
+        result.waiting = waiting_count.load();
+        result.rejected = rejected_count.load();
+        return result;
+    }
+
+    namespace {
+
+        // How many times an idle kernel thread yields before it sleeps
+        constexpr size_t worker_spin_count = 16;
+
+        // Returns true if adding count to counter stays within limit, where a
+        // limit of 0 means no limit
+        bool within(size_t counter, size_t count, size_t limit) {
+            return limit == 0 || counter <= limit || counter == count;
+        }
+
+    }  // namespace
+
+    void executor::reuse_stack(context& ctx, gthread& thread) {
+        auto size = thread.get_stack_size();
+
+        std::unique_ptr<uint64_t[]> stack;
+
+        ctx.spare_lock.lock();
+
+        if (!ctx.spare_stacks.empty() && ctx.spare_stack_size == size) {
+            stack = std::move(ctx.spare_stacks.back());
+            ctx.spare_stacks.pop_back();
+        }
+
+        ctx.spare_lock.unlock();
+
+        if (!stack) return;
+
+        // The gthread already counted its own stack when it was admitted
+        spare_bytes.fetch_sub(size);
+        stack_bytes.fetch_sub(size);
+
+        thread.use_stack(std::move(stack));
+    }
+
+    bool executor::keep_stack(context& ctx, gthread& thread) {
+        auto size = thread.get_stack_size();
+
+        // Leave the room to gthreads waiting for it
+        if (waiting_count.load() > 0) return false;
+
+        // Only stacks of one size are kept at a time. The ones of another
+        // size are freed once the lock is released
+        decltype(ctx.spare_stacks) freed;
+        size_t freed_bytes = 0;
+        auto kept = false;
+
+        ctx.spare_lock.lock();
+
+        if (ctx.spare_stack_size != size) {
+            freed_bytes = ctx.spare_stacks.size() * ctx.spare_stack_size;
+            freed.swap(ctx.spare_stacks);
+            ctx.spare_stack_size = size;
+        }
+
+        if ((ctx.spare_stacks.size() + 1) * size <= spare_stack_bytes) {
+            if (auto stack = thread.take_stack()) {
+                ctx.spare_stacks.push_back(std::move(stack));
+                spare_bytes.fetch_add(size);
+                kept = true;
+            }
+        }
+
+        ctx.spare_lock.unlock();
+
+        spare_bytes.fetch_sub(freed_bytes);
+        stack_bytes.fetch_sub(freed_bytes);
+
+        return kept;
+    }
+
+    void executor::release_spare_stacks(context& ctx) {
+        decltype(ctx.spare_stacks) freed;
+
+        ctx.spare_lock.lock();
+        freed.swap(ctx.spare_stacks);
+        auto bytes = freed.size() * ctx.spare_stack_size;
+        ctx.spare_lock.unlock();
+
+        spare_bytes.fetch_sub(bytes);
+        stack_bytes.fetch_sub(bytes);
+    }
+
+    void executor::release_spare_stacks() {
+        if (spare_bytes.load() == 0) return;
+
+        ::gthread::no_preempt guard;
+
+        std::unique_lock<std::mutex> contexts_guard(lock);
+
+        for (auto& [id, ctx] : contexts) release_spare_stacks(ctx);
+    }
+
+    bool executor::reserve_green_thread(size_t stack_size) {
+        for (auto released = false;; released = true) {
+            // Count the gthread first and take it back if that went over a
+            // limit, so that concurrent spawns can't both squeeze in. A
+            // single gthread is always let in, even if its stack alone is
+            // over the limit
+            auto live = live_count.fetch_add(1) + 1;
+            auto queued = queued_count.fetch_add(1) + 1;
+            auto bytes = stack_bytes.fetch_add(stack_size) + stack_size;
+            auto bytes_fit = within(bytes, stack_size, max_stack_bytes.load());
+
+            if (within(live, 1, max_live.load()) &&
+                within(queued, 1, max_queued.load()) && bytes_fit)
+                return true;
+
+            live_count.fetch_sub(1);
+            queued_count.fetch_sub(1);
+            stack_bytes.fetch_sub(stack_size);
+
+            // Spare stacks only hold on to room nothing else needs, so free
+            // them and try once more if they may be what is in the way
+            if (released || bytes_fit || spare_bytes.load() == 0) return false;
+
+            release_spare_stacks();
+        }
+    }
+
+    bool executor::admit_green_thread(size_t stack_size,
+                                      __impl::admission mode) {
+        if (mode == __impl::admit_always) {
+            live_count.fetch_add(1);
+            queued_count.fetch_add(1);
+            stack_bytes.fetch_add(stack_size);
+            return true;
+        }
+
+        if (reserve_green_thread(stack_size)) return true;
+
+        // What was briefly counted may have kept a waiting spawner from
+        // being let in by a gthread that stopped in the meantime
+        admit_waiting_spawners();
+
+        if (mode == __impl::admit_if_room) {
+            rejected_count.fetch_add(1);
+            return false;
+        }
+
+        auto current = current_green_thread();
+
+        // Outside of a gthread, run the scheduler until there is room
+        if (!current) {
+            while (!reserve_green_thread(stack_size)) {
+                admit_waiting_spawners();
+                yield_current_green_thread();
+            }
+
+            return true;
+        }
+
+        ::gthread::no_preempt guard;
+
+        std::unique_lock<std::mutex> admission_guard(admission_lock);
+
+        // Counted before checking again, so that a gthread stopping in the
+        // meantime either sees this one waiting or leaves room for it
+        waiting_count.fetch_add(1);
+
+        if (reserve_green_thread(stack_size)) {
+            waiting_count.fetch_sub(1);
+            return true;
+        }
+
+        // The gthread is counted on this one's behalf before it is woken
+        waiting_spawners.emplace_back(std::move(current), stack_size);
+        park_current_green_thread(admission_guard);
+
+        return true;
+    }
+
+    void executor::admit_waiting_spawners() {
+        if (waiting_count.load() == 0) return;
+
+        ::gthread::no_preempt guard;
+
+        std::unique_lock<std::mutex> admission_guard(admission_lock);
+
+        while (!waiting_spawners.empty()) {
+            auto& [thread, stack_size] = waiting_spawners.front();
+
+            if (!reserve_green_thread(stack_size)) break;
+
+            auto woken = std::move(thread);
+            waiting_spawners.pop_front();
+            waiting_count.fetch_sub(1);
+
+            wake_green_thread(std::move(woken));
+        }
+    }
+
+    void executor::start_green_thread() {
+        queued_count.fetch_sub(1);
+        admit_waiting_spawners();
+    }
+
+    void executor::release_green_thread(size_t stack_size) {
+        live_count.fetch_sub(1);
+        stack_bytes.fetch_sub(stack_size);
+        admit_waiting_spawners();
+    }
+
+    void executor::cancel_green_thread(size_t stack_size) {
+        queued_count.fetch_sub(1);
+        release_green_thread(stack_size);
+    }
+
+    size_t executor::process_green_threads(
+        size_t max_count, std::chrono::steady_clock::time_point deadline) {
+        auto previous = __impl::kernel_thread_context;
+
+        if (previous && previous->current)
+            throw std::runtime_error(
+                "Cannot run an executor from inside of a gthread");
+
+        auto& ctx = previous && previous->owner == this
+                        ? *previous
+                        : setup_kernel_thread_context();
+
+        __impl::kernel_thread_context = &ctx;
+
+        auto has_deadline =
+            deadline != std::chrono::steady_clock::time_point::max();
+
+        size_t count = 0;
+
+        while (count < max_count) {
+            if (has_deadline && std::chrono::steady_clock::now() >= deadline)
                 break;
+
+            ctx.next_lock.lock();
+            auto next = std::move(ctx.next);
+            ctx.next_lock.unlock();
+
+            // Prefer the "run next" slot to keep handoffs on this kernel
+            // thread, but only for so long before giving the queue a turn
+            if (next && ctx.next_streak < run_next_limit) {
+                ctx.current = std::move(next);
+                ctx.next_streak++;
+
+            } else {
+                lock.lock();
+
+                if (next) green_threads.push_back(std::move(next));
+
+                if (green_threads.empty()) {
+                    lock.unlock();
+                    break;
+                }
+
+                ctx.current = green_threads.front();
+                green_threads.pop_front();
+
+                lock.unlock();
+
+                ctx.next_streak = 0;
             }
 
-            ctx.current = green_threads.front();
-            green_threads.pop_front();
+            if (!ctx.current->is_setup()) {
+                start_green_thread();
+                reuse_stack(ctx, *ctx.current);
+            }
 
-            lock.unlock();
+            ctx.run_count++;
+            ctx.running = ctx.current.get();
 
             ctx.scheduling->swap(ctx.current);
 
-            if (!ctx.current->is_stopped()) {
+            ctx.running = nullptr;
+
+            if (ctx.current->is_parked()) {
+                // The gthread is now fully switched out, so it's safe to let
+                // it be woken up. If whatever it waited on is already done,
+                // it runs again right away
+                auto parked = ctx.park_commit(ctx.park_arg);
+                ctx.park_commit = nullptr;
+                ctx.park_arg = nullptr;
+
+                if (!parked) {
+                    ctx.current->unpark();
+
+                    ctx.next_lock.lock();
+                    auto displaced = std::move(ctx.next);
+                    ctx.next = std::move(ctx.current);
+                    ctx.next_lock.unlock();
+
+                    if (displaced) {
+                        lock.lock();
+                        green_threads.push_back(std::move(displaced));
+                        lock.unlock();
+                    }
+                }
+
+            } else if (!ctx.current->is_stopped()) {
                 lock.lock();
                 green_threads.push_back(ctx.current);
                 lock.unlock();
+
+            } else {
+                // The bytes of a kept stack stay counted as a spare stack
+                auto kept = keep_stack(ctx, *ctx.current);
+                release_green_thread(kept ? 0 : ctx.current->get_stack_size());
             }
 
             ctx.current = nullptr;
+
+            count++;
+        }
+
+        // A gthread left in the "run next" slot must still be ran by someone
+        // once this kernel thread stops running the executor
+        ctx.next_lock.lock();
+        auto next = std::move(ctx.next);
+        ctx.next_lock.unlock();
+
+        if (next) {
+            lock.lock();
+            green_threads.push_back(std::move(next));
+            notify_worker();
+            lock.unlock();
         }
+
+        __impl::kernel_thread_context = previous;
+
+        return count;
     }
 
-    void kernel_threads_manager::yield_current_green_thread() {
-        auto& ctx = contexts[std::this_thread::get_id()];
+    bool executor::run_one() { return process_green_threads(1) == 1; }
+
+    size_t executor::run_for(std::chrono::nanoseconds duration) {
+        auto deadline =
+            std::chrono::steady_clock::now() +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                duration);
+
+        return process_green_threads(SIZE_MAX, deadline);
+    }
+
+    size_t executor::run_until_idle() { return process_green_threads(); }
+
+    void executor::yield_current_green_thread() {
+        ::gthread::no_preempt guard;
+
+        auto ctx = find_kernel_thread_context();
+
+        // A kernel thread that is not running any executor has nothing else to
+        // do while waiting
+        if (!ctx) {
+            std::this_thread::yield();
+            return;
+        }
 
         // If the context does not have a current gthread, then this has been
         // called from the main kernel thread
-        if (!ctx.current)
-            process_green_threads();
+        if (!ctx->current)
+            ctx->owner->process_green_threads();
 
         else
-            ctx.current->swap(ctx.scheduling);
+            ctx->current->swap(ctx->scheduling);
     }
 
-    void kernel_threads_manager::exit_current_green_thread() {
-        auto& ctx = contexts[std::this_thread::get_id()];
+    void executor::exit_current_green_thread() {
+        ::gthread::no_preempt guard;
+
+        auto ctx = find_kernel_thread_context();
 
         // If the context does not have a current gthread, then this has been
         // called from the main kernel thread and an exception is thrown
-        if (!ctx.current)
+        if (!ctx || !ctx->current)
             throw std::runtime_error(
                 "Cannot exit a gthread without a current gthread to exit");
 
-        else {
-            ctx.current->stop();
-            ctx.current->swap(ctx.scheduling);
+        // Anything the gthread left in its arena is no longer reachable
+        ctx->current->arena.reset();
+
+        ctx->current->stop();
+        ctx->current->swap(ctx->scheduling);
+    }
+
+    void executor::park_current_green_thread(bool (*commit)(void*),
+                                             void* arg) {
+        ::gthread::no_preempt guard;
+
+        auto ctx = find_kernel_thread_context();
+
+        if (!ctx || !ctx->current)
+            throw std::runtime_error(
+                "Cannot park a gthread without a current gthread to park");
+
+        ctx->park_commit = commit;
+        ctx->park_arg = arg;
+        ctx->current->park();
+        ctx->current->swap(ctx->scheduling);
+    }
+
+    void executor::park_current_green_thread(
+        std::unique_lock<std::mutex>& lock) {
+        // The scheduler unlocks the mutex after the switch, so the
+        // unique_lock gives up ownership of it here
+        auto mutex = lock.release();
+
+        park_current_green_thread(
+            [](void* mutex) {
+                static_cast<std::mutex*>(mutex)->unlock();
+                return true;
+            },
+            mutex);
+    }
+
+    void executor::wake_green_thread(std::shared_ptr<gthread> thread) {
+        ::gthread::no_preempt guard;
+
+        thread->unpark();
+
+        // Handed off like a gthread spawned with same_worker, so that a
+        // gthread waiting on the one that woke it runs right after it on the
+        // same kernel thread, unless an idle one takes it first
+        auto owner = thread->owner;
+        owner->spawn_green_thread(std::move(thread), same_worker);
+    }
+
+    void executor::wake_green_threads(__impl::parked_waiter* newest) {
+        // A single waiter, such as the parent of a gthread that is finishing,
+        // is handed off like any other wake
+        if (newest && !newest->next) {
+            wake_green_thread(std::move(newest->thread));
+            return;
+        }
+
+        ::gthread::no_preempt guard;
+
+        while (newest) {
+            auto owner = newest->thread->owner;
+
+            // Consecutive gthreads of the same executor are gathered outside
+            // of its lock, then queued together. Each one goes in front of
+            // the ones gathered so far, so they run in the order they started
+            // waiting without another pass over the list
+            decltype(owner->green_threads) woken;
+
+            while (newest && newest->thread->owner == owner) {
+                // The node belongs to the woken gthread, so it must not be
+                // used once the gthread has been queued
+                auto next = newest->next;
+
+                newest->thread->unpark();
+                woken.push_front(std::move(newest->thread));
+
+                newest = next;
+            }
+
+            auto count = woken.size();
+
+            owner->lock.lock();
+            owner->green_threads.splice(owner->green_threads.end(), woken);
+
+            // There is no point in waking more kernel threads than the
+            // executor can have
+            count = std::min(count, owner->max_workers);
+
+            for (size_t i = 0; i < count; i++) owner->notify_worker();
+
+            owner->lock.unlock();
         }
     }
 
-    void kernel_threads_manager::init() {
-        setup_kernel_thread_context();
+    void executor::init() {
+        __impl::kernel_thread_context = &setup_kernel_thread_context();
 
-        auto thread_count = std::thread::hardware_concurrency() - 1;
+        start(std::max(std::thread::hardware_concurrency(), 1u) - 1);
+    }
 
-        // All kernel thread context objects are held in the same unordered_map
-        // object. All kernel threads must go into a lock loop until all threads
-        // have finished writing to the unordered_map. inited indicates how many
-        // kernel threads are in the lock loop. ack indicates how many threads
-        // have acknowledged that they are free to continue. All this is done to
-        // ensure that the unordered_map only needs to be locked during kernel
-        // thread setup. In addition, ack is used to make sure that inited does
-        // not go out of scope while kernel threads are using it.
-        std::atomic<size_t> inited = 0;
-        std::atomic<size_t> ack = 0;
-        for (size_t i = 0; i < thread_count; i++) {
-            threads.emplace_back(std::thread(
-                [&](bool* running) {
-                    setup_kernel_thread_context();
-                    inited++;
+    void executor::start(size_t thread_count) {
+        ::gthread::no_preempt preempt_guard;
 
-                    while (inited != thread_count) {
-                    }
+        std::unique_lock<std::mutex> guard(lock);
 
-                    ack++;
+        running = true;
+        drain_deadline = std::chrono::steady_clock::time_point::max();
+        max_workers = thread_count;
 
-                    while (*running) {
-                        process_green_threads();
+        while (threads.size() < std::min(min_workers, max_workers))
+            add_worker();
 
-                        std::this_thread::yield();
-                    }
-                },
-                &running));
+        if (!green_threads.empty()) notify_worker();
+    }
+
+    void executor::set_worker_limits(size_t min_count, size_t max_count) {
+        ::gthread::no_preempt preempt_guard;
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        min_workers = std::min(min_count, max_count);
+        max_workers = max_count;
+
+        if (!running) return;
+
+        while (threads.size() < min_workers) add_worker();
+
+        // Kernel threads over the new maximum exit once they are idle
+        work_available.notify_all();
+    }
+
+    void executor::notify_worker() {
+        if (idle_workers > 0)
+            work_available.notify_one();
+
+        else if (running && threads.size() < max_workers)
+            add_worker();
+    }
+
+    void executor::add_worker() {
+        for (auto& thread : retired_threads) thread.join();
+
+        retired_threads.clear();
+
+        std::thread thread(&executor::run_worker, this);
+        auto id = thread.get_id();
+        threads.emplace(id, std::move(thread));
+    }
+
+    void executor::run_worker() {
+        __impl::kernel_thread_context = &setup_kernel_thread_context();
+
+        std::unique_lock<std::mutex> guard(lock);
+
+        size_t spins = 0;
+
+        while (true) {
+            auto deadline = drain_deadline;
+
+            if ((!green_threads.empty() || steal_next()) &&
+                std::chrono::steady_clock::now() < deadline) {
+                guard.unlock();
+
+                // Run a few at a time, so that a new deadline is seen soon
+                process_green_threads(64, deadline);
+
+                guard.lock();
+                spins = 0;
+                continue;
+            }
+
+            if (!running) break;
+
+            if (threads.size() > max_workers) break;
+
+            // Work often shows up right after the queue runs dry, so check a
+            // few more times before paying for a sleep and a wake up
+            if (spins < worker_spin_count) {
+                spins++;
+
+                guard.unlock();
+                std::this_thread::yield();
+                guard.lock();
+                continue;
+            }
+
+            spins = 0;
+            idle_workers++;
+
+            auto woken = work_available.wait_for(
+                guard, worker_idle_timeout,
+                [&] {
+                    return !green_threads.empty() || !running || steal_next();
+                });
+
+            idle_workers--;
+
+            if (!woken && threads.size() > min_workers) break;
+        }
+
+        // Removed before the kernel thread can be joined, since it is joined
+        // with lock held
+        remove_kernel_thread_context();
+
+        // Only stop_workers joins the kernel threads once the executor is
+        // stopped, otherwise whoever creates the next one does
+        if (running) {
+            auto it = threads.find(std::this_thread::get_id());
+            retired_threads.push_back(std::move(it->second));
+            threads.erase(it);
+        }
+    }
+
+    bool executor::steal_next() {
+        for (auto& [id, ctx] : contexts) {
+            // A kernel thread in its scheduler is about to run it anyway
+            if (!ctx.running.load()) continue;
+
+            ctx.next_lock.lock();
+            auto thread = std::move(ctx.next);
+            ctx.next_lock.unlock();
+
+            if (thread) {
+                green_threads.push_back(std::move(thread));
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void executor::stop_workers(
+        std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> guard(lock);
+
+        running = false;
+        drain_deadline = deadline;
+        work_available.notify_all();
+
+        auto stopping = std::move(threads);
+        auto retired = std::move(retired_threads);
+        threads.clear();
+        retired_threads.clear();
+
+        guard.unlock();
+
+        for (auto& [id, thread] : stopping) thread.join();
+        for (auto& thread : retired) thread.join();
+    }
+
+    void executor::enable_preemption(
+        std::chrono::microseconds slice) {
+#ifdef __linux__
+        ::gthread::no_preempt preempt_guard;
+
+        disable_preemption();
+
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            dl_iterate_phdr(__impl::find_code_ranges, nullptr);
+
+            struct sigaction action = {};
+            action.sa_sigaction = __impl::preemption_handler;
+            action.sa_flags = SA_SIGINFO | SA_RESTART | SA_NODEFER;
+            sigemptyset(&action.sa_mask);
+            sigaction(__impl::preemption_signal, &action, nullptr);
+        });
+
+        std::unique_lock<std::mutex> guard(preemption_lock);
+
+        preemption_enabled = true;
+
+        preemption_monitor = std::thread([this, slice] {
+            std::unique_lock<std::mutex> guard(preemption_lock);
+
+            struct last_switch {
+                uint64_t run_count = 0;
+                std::chrono::steady_clock::time_point time;
+            };
+
+            std::unordered_map<context*, last_switch> last_switches;
+
+            // Check several times per slice, so that a gthread that was
+            // outside of the main executable when signaled is retried soon
+            auto interval = std::max(slice / 4, std::chrono::microseconds(50));
+
+            while (!preemption_stop.wait_for(
+                guard, interval, [&] { return !preemption_enabled; })) {
+                auto now = std::chrono::steady_clock::now();
+
+                for (auto& [ctx, handle] : kernel_thread_handles) {
+                    auto run_count = ctx->run_count.load();
+                    auto& last = last_switches[ctx];
+
+                    if (run_count != last.run_count) {
+                        last.run_count = run_count;
+                        last.time = now;
+
+                    } else if (ctx->running.load() && now - last.time >= slice)
+                        pthread_kill(handle, __impl::preemption_signal);
+                }
+            }
+        });
+#else
+        (void)slice;
+        throw std::runtime_error(
+            "Preemption is not supported on this platform");
+#endif
+    }
+
+    void executor::disable_preemption() {
+        ::gthread::no_preempt preempt_guard;
+
+        std::unique_lock<std::mutex> guard(preemption_lock);
+
+        if (!preemption_enabled) return;
+
+        preemption_enabled = false;
+        preemption_stop.notify_all();
+
+        guard.unlock();
+
+        preemption_monitor.join();
+    }
+
+    void executor::finish() {
+        ::gthread::no_preempt guard;
+
+        disable_preemption();
+
+        // There may be no kernel threads to drain the queue otherwise
+        auto ctx = find_kernel_thread_context();
+
+        lock.lock();
+        auto queued = !green_threads.empty();
+        lock.unlock();
+
+        if (queued && (!ctx || !ctx->current)) process_green_threads();
+
+        stop_workers(std::chrono::steady_clock::time_point::max());
+    }
+
+    bool executor::shutdown(std::chrono::nanoseconds drain_deadline) {
+        auto ctx = find_kernel_thread_context();
+
+        if (ctx && ctx->current && ctx->owner == this)
+            throw std::runtime_error(
+                "Cannot shut down an executor from one of its gthreads");
+
+        // It may be called from a gthread of another executor, which must
+        // not be preempted while holding a lock
+        ::gthread::no_preempt guard;
+
+        disable_preemption();
+
+        auto now = std::chrono::steady_clock::now();
+        auto deadline = std::chrono::steady_clock::time_point::max();
+
+        if (drain_deadline < deadline - now)
+            deadline =
+                now +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    drain_deadline);
+
+        lock.lock();
+        this->drain_deadline = deadline;
+        lock.unlock();
+
+        // Help drain the queue, unless this kernel thread is busy running a
+        // gthread of another executor
+        if (!ctx || !ctx->current) process_green_threads(SIZE_MAX, deadline);
+
+        stop_workers(deadline);
+
+        // Whatever is left could not be ran in time. Dropping a gthread
+        // breaks its promise, which queues the gthreads waiting on it again,
+        // so keep going until the queue stays empty
+        size_t dropped_count = 0;
+
+        while (true) {
+            lock.lock();
+            auto dropped = std::move(green_threads);
+            green_threads.clear();
+            lock.unlock();
+
+            if (dropped.empty()) break;
+
+            dropped_count += dropped.size();
+
+            for (auto& thread : dropped) {
+                if (thread->is_setup()) {
+                    // It never runs again, but may still be referenced
+                    thread->take_stack();
+                    release_green_thread(thread->get_stack_size());
+                    continue;
+                }
+
+                thread->drop();
+                cancel_green_thread(thread->get_stack_size());
+            }
         }
 
-        // Wait for all kernel threads to acknowledge that it's done with inited
-        // so it can go out of scope
-        while (ack != thread_count) {
+        // Kernel threads that ran the executor without being one of its
+        // workers still hold on to their spare stacks
+        release_spare_stacks();
+
+        return dropped_count == 0;
+    }
+
+}  // namespace gthread
+
+namespace gthread::__impl {
+
+    void blocking_pool::submit(Function function, void* user_params) {
+        ::gthread::no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(lock);
+
+        // Nothing is left to run it after finish
+        if (!running) {
+            guard.unlock();
+            function(user_params);
+            return;
         }
+
+        jobs.emplace_back(function, user_params);
+
+        for (auto& thread : retired) thread.join();
+
+        retired.clear();
+
+        // Only grow the pool when every idle thread already has a job waiting
+        // for it
+        if (jobs.size() > idle_count && threads.size() < max_blocking_threads) {
+            std::thread thread(&blocking_pool::run, this);
+            auto id = thread.get_id();
+            threads.emplace(id, std::move(thread));
+
+        } else
+            available.notify_one();
     }
 
-    void kernel_threads_manager::finish() {
+    void blocking_pool::run() {
+        std::unique_lock<std::mutex> guard(lock);
+
+        while (true) {
+            if (jobs.empty()) {
+                if (!running) break;
+
+                idle_count++;
+
+                auto woken = available.wait_for(
+                    guard, blocking_idle_timeout,
+                    [&] { return !jobs.empty() || !running; });
+
+                idle_count--;
+
+                if (!woken) break;
+
+                continue;
+            }
+
+            auto [function, user_params] = jobs.front();
+            jobs.pop_front();
+
+            guard.unlock();
+            function(user_params);
+            guard.lock();
+        }
+
+        // The thread can't join itself, so it's joined by the next submit or
+        // finish. While running, the handle is always in threads
+        auto it = threads.find(std::this_thread::get_id());
+
+        if (it != threads.end()) {
+            retired.emplace_back(std::move(it->second));
+            threads.erase(it);
+        }
+    }
+
+    void blocking_pool::finish() {
+        std::unique_lock<std::mutex> guard(lock);
+
         running = false;
+        available.notify_all();
+
+        std::list<std::thread> to_join = std::move(retired);
+        retired.clear();
 
-        for (auto& thread : threads) thread.join();
+        for (auto& [id, thread] : threads)
+            to_join.emplace_back(std::move(thread));
 
         threads.clear();
+
+        guard.unlock();
+
+        for (auto& thread : to_join) thread.join();
+    }
+
+}  // namespace gthread::__impl
+
+namespace gthread {
+
+    no_preempt::no_preempt() : thread{nullptr} {
+        // Set before the context is read, so that the gthread can't move to
+        // another kernel thread between reading it and being marked
+        __impl::entering_no_preempt = 1;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+
+        auto ctx = __impl::kernel_thread_context;
+
+        if (ctx) thread = ctx->running.load();
+
+        if (thread) {
+            thread->preemptible = 0;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            thread->no_preempt_depth++;
+        }
+
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        __impl::entering_no_preempt = 0;
+    }
+
+    no_preempt::~no_preempt() {
+        if (!thread) return;
+
+        if (--thread->no_preempt_depth != 0) return;
+
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        thread->preemptible = 1;
+
+        // The gthread ran past its time slice while it couldn't be preempted
+        if (thread->preempt_pending) yield();
     }
 
-}  // namespace gthread::__impl
\ No newline at end of file
+}  // namespace gthread
\ No newline at end of file
@@ -0,0 +1,97 @@
+#include <gthread.hpp>
+
+namespace gthread::__impl {
+
+    void actor_core::fail(std::exception_ptr e) {
+        std::vector<std::weak_ptr<actor_core>> linked;
+
+        {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            if (stopped.load()) return;
+
+            failure = e;
+            stopped.store(true);
+            linked.swap(links);
+        }
+
+        for (auto& weak : linked)
+            if (auto other = weak.lock()) other->post_failure(e);
+    }
+
+    void actor_core::handle_link_failure(std::exception_ptr e) {
+        std::function<void(std::exception_ptr)> handler;
+
+        {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+            handler = link_failure_handler;
+        }
+
+        if (!handler) {
+            fail(e);
+            return;
+        }
+
+        try {
+            handler(e);
+        } catch (...) {
+            fail(std::current_exception());
+        }
+    }
+
+    void actor_core::link(const std::shared_ptr<actor_core>& lhs,
+                          const std::shared_ptr<actor_core>& rhs) {
+        if (lhs == rhs) return;
+
+        std::exception_ptr lhs_failure;
+        std::exception_ptr rhs_failure;
+
+        {
+            no_preempt preempt_guard;
+            std::scoped_lock guard(lhs->lock, rhs->lock);
+
+            lhs_failure = lhs->failure;
+            rhs_failure = rhs->failure;
+
+            if (!lhs->stopped.load() && !rhs->stopped.load()) {
+                lhs->links.push_back(rhs);
+                rhs->links.push_back(lhs);
+            }
+        }
+
+        // One of them has already failed, so tell the other right away
+        if (lhs_failure) rhs->post_failure(lhs_failure);
+        if (rhs_failure) lhs->post_failure(rhs_failure);
+    }
+
+    void actor_core::on_link_failure(
+        std::function<void(std::exception_ptr)> handler) {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(lock);
+        link_failure_handler = std::move(handler);
+    }
+
+    void actor_core::stop() {
+        {
+            no_preempt preempt_guard;
+            std::unique_lock<std::mutex> guard(lock);
+
+            if (stopped.load()) return;
+
+            stopped.store(true);
+            links.clear();
+        }
+
+        // Discard the messages that are still queued
+        schedule();
+    }
+
+    std::exception_ptr actor_core::get_failure() {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(lock);
+        return failure;
+    }
+
+}  // namespace gthread::__impl
\ No newline at end of file
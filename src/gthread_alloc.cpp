@@ -0,0 +1,220 @@
+#include <atomic>
+#include <gthread.hpp>
+#include <stdexcept>
+
+namespace gthread::__impl {
+
+    namespace {
+
+        // Sizes are rounded up to one of these classes. The classes are 16
+        // bytes apart up to 128 bytes, then four classes per power of two
+        constexpr size_t size_classes[] = {
+            16,   32,   48,   64,   80,   96,   112,  128,  160,  192,
+            224,  256,  320,  384,  448,  512,  640,  768,  896,  1024,
+            1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096};
+
+        constexpr size_t class_count =
+            sizeof(size_classes) / sizeof(size_classes[0]);
+
+        // Maps (size + 15) / 16 to a size class
+        struct class_table {
+            uint8_t classes[max_small_allocation / 16 + 1];
+
+            constexpr class_table() : classes{} {
+                size_t size_class = 0;
+
+                for (size_t i = 0; i <= max_small_allocation / 16; i++) {
+                    while (size_classes[size_class] < i * 16) size_class++;
+
+                    classes[i] = static_cast<uint8_t>(size_class);
+                }
+            }
+        };
+
+        constexpr class_table table;
+
+        // Slabs are carved out of chunks of this size, which are never freed
+        constexpr size_t chunk_size = 64 * 1024;
+
+        // How many blocks of a size class a kernel thread keeps before
+        // handing half of them back to the depot
+        constexpr size_t max_cached_bytes = 64 * 1024;
+
+        struct free_block {
+            free_block* next;
+        };
+
+        // A free list shared by all kernel threads. It uses a spin lock so
+        // that it has no destructor and can still be used by kernel threads
+        // exiting after static destruction has started
+        struct depot {
+            std::atomic_flag lock = ATOMIC_FLAG_INIT;
+            free_block* head = nullptr;
+            size_t count = 0;
+
+            void acquire() {
+                while (lock.test_and_set(std::memory_order_acquire))
+                    std::this_thread::yield();
+            }
+
+            void release() { lock.clear(std::memory_order_release); }
+        };
+
+        depot depots[class_count];
+
+        // The free lists of one kernel thread
+        struct thread_cache {
+            free_block* heads[class_count] = {};
+            size_t counts[class_count] = {};
+
+            // Takes up to count blocks from the depot, carving a new chunk
+            // if the depot is empty
+            void refill(size_t size_class) {
+                auto size = size_classes[size_class];
+                auto count = std::max<size_t>(max_cached_bytes / size / 2, 1);
+                auto& shared = depots[size_class];
+
+                shared.acquire();
+
+                while (shared.head && count > 0) {
+                    auto block = shared.head;
+                    shared.head = block->next;
+                    shared.count--;
+
+                    block->next = heads[size_class];
+                    heads[size_class] = block;
+                    counts[size_class]++;
+                    count--;
+                }
+
+                shared.release();
+
+                if (heads[size_class]) return;
+
+                auto chunk = static_cast<char*>(::operator new(chunk_size));
+
+                for (size_t offset = 0; offset + size <= chunk_size;
+                     offset += size) {
+                    auto block = reinterpret_cast<free_block*>(chunk + offset);
+                    block->next = heads[size_class];
+                    heads[size_class] = block;
+                    counts[size_class]++;
+                }
+            }
+
+            // Hands count blocks back to the depot
+            void flush(size_t size_class, size_t count) {
+                if (count == 0) return;
+
+                auto first = heads[size_class];
+                auto last = first;
+
+                for (size_t i = 1; i < count; i++) last = last->next;
+
+                heads[size_class] = last->next;
+                counts[size_class] -= count;
+
+                auto& shared = depots[size_class];
+
+                shared.acquire();
+                last->next = shared.head;
+                shared.head = first;
+                shared.count += count;
+                shared.release();
+            }
+
+            ~thread_cache() {
+                for (size_t i = 0; i < class_count; i++) flush(i, counts[i]);
+            }
+        };
+
+        thread_local thread_cache cache;
+
+    }  // namespace
+
+}  // namespace gthread::__impl
+
+namespace gthread {
+
+    void* allocate(size_t size) {
+        if (size > max_small_allocation) return ::operator new(size);
+
+        // The cache belongs to the kernel thread, so the gthread must not be
+        // moved to another one in the middle of using it
+        no_preempt guard;
+
+        auto size_class = __impl::table.classes[(size + 15) / 16];
+        auto& cache = __impl::cache;
+
+        if (!cache.heads[size_class]) cache.refill(size_class);
+
+        auto block = cache.heads[size_class];
+        cache.heads[size_class] = block->next;
+        cache.counts[size_class]--;
+
+        return block;
+    }
+
+    void deallocate(void* pointer, size_t size) noexcept {
+        if (!pointer) return;
+
+        if (size > max_small_allocation) {
+            ::operator delete(pointer);
+            return;
+        }
+
+        no_preempt guard;
+
+        auto size_class = __impl::table.classes[(size + 15) / 16];
+        auto& cache = __impl::cache;
+
+        auto block = static_cast<__impl::free_block*>(pointer);
+        block->next = cache.heads[size_class];
+        cache.heads[size_class] = block;
+        cache.counts[size_class]++;
+
+        auto limit =
+            __impl::max_cached_bytes / __impl::size_classes[size_class];
+
+        if (cache.counts[size_class] > limit)
+            cache.flush(size_class, cache.counts[size_class] / 2);
+    }
+
+    void arena::grow(size_t size, size_t alignment) {
+        // Blocks double in size, starting small enough to come from the size
+        // class slabs
+        auto block_size = blocks ? blocks->size * 2 : 1024;
+        block_size = std::min<size_t>(block_size, 64 * 1024);
+        block_size = std::max(block_size, sizeof(block) + size + alignment);
+
+        auto new_block = static_cast<block*>(::gthread::allocate(block_size));
+        new_block->next = blocks;
+        new_block->size = block_size;
+        blocks = new_block;
+
+        cursor = reinterpret_cast<char*>(new_block + 1);
+        limit = reinterpret_cast<char*>(new_block) + block_size;
+    }
+
+    void arena::reset() noexcept {
+        while (blocks) {
+            auto next = blocks->next;
+            ::gthread::deallocate(blocks, blocks->size);
+            blocks = next;
+        }
+
+        cursor = nullptr;
+        limit = nullptr;
+    }
+
+    arena& task_arena() {
+        auto current = __impl::scheduler::find_kernel_thread_context();
+
+        if (!current || !current->current)
+            throw std::runtime_error(
+                "Cannot get the task arena without a current gthread");
+
+        return current->current->arena;
+    }
+
+}  // namespace gthread
\ No newline at end of file
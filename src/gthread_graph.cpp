@@ -0,0 +1,282 @@
+#include <gthread.hpp>
+#include <stdexcept>
+
+namespace gthread {
+
+    graph::node& graph::node::precede(node other) {
+        if (owner != other.owner || !owner)
+            throw std::runtime_error(
+                "Cannot add an edge between nodes of different graphs");
+
+        if (owner->running.load())
+            throw std::runtime_error("Cannot add an edge to a running graph");
+
+        owner->edges.emplace_back(index, other.index);
+        owner->edges_changed = true;
+
+        return *this;
+    }
+
+    graph::node& graph::node::succeed(node other) {
+        other.precede(*this);
+        return *this;
+    }
+
+    graph::node graph::add(node_data&& data) {
+        if (running.load())
+            throw std::runtime_error("Cannot add a node to a running graph");
+
+        data.owner = this;
+        nodes.push_back(std::move(data));
+        edges_changed = true;
+
+        return node(this, static_cast<uint32_t>(nodes.size() - 1));
+    }
+
+    graph::node graph::emplace(std::function<void()> work) {
+        node_data data;
+        data.kind = work_node;
+        data.work = std::move(work);
+
+        return add(std::move(data));
+    }
+
+    graph::node graph::emplace_condition(std::function<size_t()> condition) {
+        node_data data;
+        data.kind = condition_node;
+        data.condition = std::move(condition);
+
+        return add(std::move(data));
+    }
+
+    graph::node graph::emplace_subgraph(graph& sub) {
+        if (&sub == this)
+            throw std::runtime_error("A graph cannot be its own subgraph");
+
+        node_data data;
+        data.kind = subgraph_node;
+        data.subgraph = &sub;
+
+        return add(std::move(data));
+    }
+
+    void graph::clear() {
+        if (running.load())
+            throw std::runtime_error("Cannot clear a running graph");
+
+        nodes.clear();
+        edges.clear();
+        successors.clear();
+        edges_changed = false;
+    }
+
+    void graph::build() {
+        for (auto& data : nodes) {
+            data.conditional = false;
+            data.predecessors = 0;
+            data.successors_begin = 0;
+            data.successors_end = 0;
+        }
+
+        // A counting sort by the node the edge starts from, which keeps the
+        // order the edges were added in for condition nodes
+        for (auto& [from, to] : edges) {
+            nodes[from].successors_end++;
+
+            if (nodes[from].kind == condition_node)
+                nodes[to].conditional = true;
+            else
+                nodes[to].predecessors++;
+        }
+
+        uint32_t offset = 0;
+
+        for (auto& data : nodes) {
+            auto count = data.successors_end;
+            data.successors_begin = offset;
+            data.successors_end = offset;
+            offset += count;
+        }
+
+        successors.resize(edges.size());
+
+        for (auto& [from, to] : edges)
+            successors[nodes[from].successors_end++] = to;
+
+        if (counter_count < nodes.size()) {
+            counters = std::make_unique<std::atomic<uint32_t>[]>(nodes.size());
+            counter_count = nodes.size();
+        }
+
+        edges_changed = false;
+    }
+
+    void graph::start(executor& on, completion done, void* done_arg,
+                      promise<void>* result) {
+        if (running.exchange(true))
+            throw std::runtime_error("Cannot run a graph that is running");
+
+        if (result) finished = std::move(*result);
+
+        if (edges_changed) {
+            try {
+                build();
+            } catch (...) {
+                running.store(false);
+                throw;
+            }
+        }
+
+        this->on = &on;
+        this->done = done;
+        this->done_arg = done_arg;
+        failed.store(false);
+        error = nullptr;
+
+        size_t sources = 0;
+
+        for (uint32_t i = 0; i < nodes.size(); i++) {
+            counters[i].store(nodes[i].predecessors,
+                              std::memory_order_relaxed);
+
+            if (nodes[i].predecessors == 0 && !nodes[i].conditional)
+                sources++;
+        }
+
+        if (sources == 0) {
+            complete();
+            return;
+        }
+
+        // Every source is counted before any of them runs, so that the run
+        // can't complete while they are still being created
+        active.store(sources);
+
+        for (uint32_t i = 0; i < nodes.size(); i++)
+            if (nodes[i].predecessors == 0 && !nodes[i].conditional)
+                execute(on, any_worker, run_node, this, i);
+    }
+
+    void graph::run_from(uint32_t index) {
+        while (index != no_node) {
+            auto& data = nodes[index];
+
+            // Reset the counter so that the node can run again in a loop
+            counters[index].store(data.predecessors,
+                                  std::memory_order_relaxed);
+
+            size_t chosen = SIZE_MAX;
+
+            if (!failed.load()) {
+                try {
+                    switch (data.kind) {
+                        case work_node:
+                            data.work();
+                            break;
+
+                        case condition_node:
+                            chosen = data.condition();
+                            break;
+
+                        case subgraph_node:
+                            // The subgraph calls subgraph_done once it has
+                            // finished, which carries on from this node
+                            data.subgraph->start(*on, subgraph_done,
+                                                 &data);
+                            return;
+                    }
+                } catch (...) {
+                    if (!failed.exchange(true))
+                        error = std::current_exception();
+                }
+            }
+
+            index = finish(index, chosen);
+        }
+    }
+
+    uint32_t graph::finish(uint32_t index, size_t chosen) {
+        auto& data = nodes[index];
+        auto next = no_node;
+
+        auto ready = [&](uint32_t successor) {
+            if (next == no_node) {
+                next = successor;
+                return;
+            }
+
+            active.fetch_add(1);
+            execute(*on, any_worker, run_node, this, successor);
+        };
+
+        if (!failed.load()) {
+            if (data.kind == condition_node) {
+                auto count = data.successors_end - data.successors_begin;
+
+                if (chosen < count)
+                    ready(successors[data.successors_begin + chosen]);
+            }
+
+            else {
+                for (auto i = data.successors_begin; i < data.successors_end;
+                     i++) {
+                    auto successor = successors[i];
+
+                    if (counters[successor].fetch_sub(1) == 1)
+                        ready(successor);
+                }
+            }
+        }
+
+        // The caller carries on with next, so the node stays counted as
+        // active
+        if (next == no_node && active.fetch_sub(1) == 1) complete();
+
+        return next;
+    }
+
+    void graph::complete() {
+        auto done = this->done;
+        auto done_arg = this->done_arg;
+        auto error = std::move(this->error);
+        auto result = std::move(finished);
+
+        // The graph may be ran again as soon as the run is reported done
+        running.store(false);
+
+        if (done)
+            done(done_arg, std::move(error));
+
+        else if (error)
+            result.raise(std::move(error));
+
+        else
+            result.set();
+    }
+
+    void graph::run_node(graph* self, uint32_t index) {
+        self->run_from(index);
+    }
+
+    void graph::subgraph_done(void* arg, std::exception_ptr e) {
+        // arg is the subgraph node of the parent graph
+        auto data = static_cast<node_data*>(arg);
+        auto parent = data->owner;
+
+        if (e && !parent->failed.exchange(true)) parent->error = std::move(e);
+
+        auto index = static_cast<uint32_t>(data - parent->nodes.data());
+
+        parent->run_from(parent->finish(index, SIZE_MAX));
+    }
+
+    future<void> graph::run(executor& on) {
+        promise<void> p;
+        auto f = p.get_future();
+
+        start(on, nullptr, nullptr, &p);
+
+        return f;
+    }
+
+}  // namespace gthread
\ No newline at end of file
@@ -0,0 +1,56 @@
+#include <gthread.hpp>
+
+namespace gthread::__impl {
+
+    void pipeline_gate::reset() {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(lock);
+
+        busy = false;
+        next = 0;
+        waiting.clear();
+    }
+
+    void pipeline_gate::enter(uint64_t sequence) {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(lock);
+
+        if (!busy && (!in_order || sequence == next)) {
+            busy = true;
+            return;
+        }
+
+        // The token leaving the gate hands it over, so the gate is already
+        // ours once this gthread is woken
+        waiting.emplace_back(sequence, scheduler::current_green_thread());
+        scheduler::park_current_green_thread(guard);
+    }
+
+    void pipeline_gate::leave() {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(lock);
+
+        auto it = waiting.begin();
+
+        if (in_order) {
+            next++;
+
+            while (it != waiting.end() && it->first != next) it++;
+        }
+
+        if (it == waiting.end()) {
+            busy = false;
+            return;
+        }
+
+        auto thread = std::move(it->second);
+        waiting.erase(it);
+
+        guard.unlock();
+
+        // Queued for any kernel thread, as this token goes on to the next
+        // stage instead of waiting
+        scheduler::wake_green_thread(std::move(thread));
+    }
+
+}  // namespace gthread::__impl
\ No newline at end of file
@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <atomic>
+#include <gthread.hpp>
+#include <map>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include <cerrno>
+#include <cstdlib>
+#endif
+
+namespace gthread::__impl {
+
+    namespace {
+
+        constexpr size_t max_frames = 32;
+
+        // Where a sample was taken when it was not taken in a gthread
+        enum sample_kind : uint32_t { in_gthread, in_scheduler, in_other };
+
+        // One sample, written by the signal handler. frames holds return
+        // addresses, starting with the interrupted instruction
+        struct sample {
+            const std::type_info* spawn_type;
+            void* spawn_address;
+            uint32_t kind;
+            uint32_t depth;
+            uintptr_t frames[max_frames];
+        };
+
+        // Samples are written into a buffer allocated up front, as the signal
+        // handler can't allocate
+        struct sampler {
+            std::mutex lock;
+            std::unique_ptr<sample[]> samples;
+            size_t capacity = 0;
+            std::atomic<size_t> count = 0;
+            std::atomic<size_t> dropped = 0;
+
+            // Checked by the signal handler, as a signal may still be pending
+            // after the timer is stopped
+            std::atomic<bool> active = false;
+
+            // Signal handlers that may be writing a sample right now
+            std::atomic<size_t> writers = 0;
+        };
+
+        sampler profile;
+
+        // Stops the timer and waits for signal handlers that are still
+        // writing a sample, so that the samples can be read or reset.
+        // profile.lock must be held
+        void stop_sampling() {
+#ifdef __linux__
+            if (!profile.active) return;
+
+            itimerval timer = {};
+            setitimer(ITIMER_PROF, &timer, nullptr);
+
+            // A signal may already be pending, so keep the handler installed
+            // but make sure it does nothing
+            profile.active = false;
+
+            while (profile.writers.load() != 0) std::this_thread::yield();
+#endif
+        }
+
+#ifdef __linux__
+        // Writes a sample of the interrupted state. Called from the signal
+        // handler
+        void take_sample(void* ucontext) {
+            auto index = profile.count.fetch_add(1);
+
+            if (index >= profile.capacity) {
+                profile.count.fetch_sub(1);
+                profile.dropped.fetch_add(1);
+                return;
+            }
+
+            auto& s = profile.samples[index];
+            auto& mcontext = static_cast<ucontext_t*>(ucontext)->uc_mcontext;
+
+#ifdef __x86_64__
+            auto pc = static_cast<uintptr_t>(mcontext.gregs[REG_RIP]);
+            auto fp = static_cast<uintptr_t>(mcontext.gregs[REG_RBP]);
+#else
+            auto pc = static_cast<uintptr_t>(mcontext.gregs[REG_EIP]);
+            auto fp = static_cast<uintptr_t>(mcontext.gregs[REG_EBP]);
+#endif
+
+            s.spawn_type = nullptr;
+            s.spawn_address = nullptr;
+            s.depth = 0;
+            s.frames[s.depth++] = pc;
+
+            auto ctx = scheduler::find_kernel_thread_context();
+            auto thread = ctx ? ctx->running.load() : nullptr;
+
+            if (!thread) {
+                s.kind = ctx ? in_scheduler : in_other;
+                return;
+            }
+
+            s.kind = in_gthread;
+            s.spawn_type = thread->spawn_type;
+            s.spawn_address = thread->spawn_address;
+
+            // Only follow frame pointers that stay within the gthread's stack,
+            // anything else is either the end of the stack or not a frame
+            // pointer at all
+            auto begin = reinterpret_cast<uintptr_t>(thread->stack_begin());
+            auto end = reinterpret_cast<uintptr_t>(thread->stack_end());
+
+            while (s.depth < max_frames && fp >= begin &&
+                   fp + 2 * sizeof(uintptr_t) <= end &&
+                   fp % sizeof(uintptr_t) == 0) {
+                auto frame = reinterpret_cast<uintptr_t*>(fp);
+
+                if (frame[1] == 0) break;
+
+                s.frames[s.depth++] = frame[1];
+
+                if (frame[0] <= fp) break;
+
+                fp = frame[0];
+            }
+        }
+
+        void profile_handler(int, siginfo_t*, void* ucontext) {
+            // Counted before checking active, so that stop_sampling either
+            // waits for this sample or keeps it from being taken
+            profile.writers.fetch_add(1);
+
+            if (!profile.active.load()) {
+                profile.writers.fetch_sub(1);
+                return;
+            }
+
+            auto saved_errno = errno;
+
+            take_sample(ucontext);
+
+            errno = saved_errno;
+
+            profile.writers.fetch_sub(1);
+        }
+
+        std::string demangle(const char* name) {
+            int status = 0;
+            auto demangled =
+                abi::__cxa_demangle(name, nullptr, nullptr, &status);
+
+            if (status != 0 || !demangled) return name;
+
+            std::string result = demangled;
+            std::free(demangled);
+            return result;
+        }
+
+        // Returns the name of the function containing address. Return
+        // addresses point after the call, so is_return_address looks up the
+        // call instruction instead
+        std::string symbolize(uintptr_t address, bool is_return_address) {
+            Dl_info info;
+
+            if (dladdr(reinterpret_cast<void*>(address - is_return_address),
+                       &info) &&
+                info.dli_sname)
+                return demangle(info.dli_sname);
+
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "0x%zx",
+                     static_cast<size_t>(address));
+            return buffer;
+        }
+
+        std::string spawn_site_name(const sample& s) {
+            switch (s.kind) {
+                case in_gthread:
+                    break;
+                case in_scheduler:
+                    return "[scheduler]";
+                case in_other:
+                    return "[kernel thread]";
+            }
+
+            if (s.spawn_address) {
+                Dl_info info;
+
+                if (dladdr(s.spawn_address, &info) && info.dli_sname)
+                    return demangle(info.dli_sname);
+            }
+
+            if (s.spawn_type) return demangle(s.spawn_type->name());
+
+            return "[unknown]";
+        }
+#endif
+
+    }  // namespace
+
+}  // namespace gthread::__impl
+
+namespace gthread::profiler {
+
+    using __impl::profile;
+
+    void start(unsigned frequency, size_t max_samples) {
+#ifdef __linux__
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(profile.lock);
+
+        if (profile.active) return;
+
+        if (!profile.samples || profile.capacity != max_samples) {
+            profile.capacity = 0;
+            profile.samples = std::make_unique<__impl::sample[]>(max_samples);
+            profile.count = 0;
+            profile.capacity = max_samples;
+        }
+
+        struct sigaction action = {};
+        action.sa_sigaction = __impl::profile_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+
+        // A gthread must not be preempted in the middle of writing a sample,
+        // or stop would wait for it to be scheduled again
+        sigaddset(&action.sa_mask, SIGURG);
+        sigaction(SIGPROF, &action, nullptr);
+
+        if (frequency == 0) frequency = 1;
+
+        auto interval = 1000000 / frequency;
+
+        itimerval timer = {};
+        timer.it_interval.tv_sec = interval / 1000000;
+        timer.it_interval.tv_usec = interval % 1000000;
+        timer.it_value = timer.it_interval;
+
+        profile.active = true;
+
+        setitimer(ITIMER_PROF, &timer, nullptr);
+#else
+        (void)frequency;
+        (void)max_samples;
+        throw std::runtime_error(
+            "Profiling is not supported on this platform");
+#endif
+    }
+
+    void stop() {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(profile.lock);
+
+        __impl::stop_sampling();
+    }
+
+    void write_folded(std::ostream& out) {
+#ifdef __linux__
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(profile.lock);
+
+        __impl::stop_sampling();
+
+        auto count = std::min(profile.count.load(), profile.capacity);
+
+        std::unordered_map<uintptr_t, std::string> names;
+        std::map<std::string, size_t> stacks;
+
+        for (size_t i = 0; i < count; i++) {
+            auto& s = profile.samples[i];
+
+            std::string stack = __impl::spawn_site_name(s);
+
+            // Frames are stored from the innermost out, folded stacks start
+            // from the outermost frame
+            for (auto depth = s.depth; depth > 0; depth--) {
+                auto address = s.frames[depth - 1];
+                auto is_return_address = depth - 1 != 0;
+                auto key = address - is_return_address;
+
+                auto it = names.find(key);
+
+                if (it == names.end())
+                    it = names
+                             .emplace(key, __impl::symbolize(
+                                               address, is_return_address))
+                             .first;
+
+                stack += ';';
+                stack += it->second;
+            }
+
+            stacks[stack]++;
+        }
+
+        for (auto& [stack, samples] : stacks)
+            out << stack << ' ' << samples << '\n';
+#else
+        (void)out;
+#endif
+    }
+
+    void clear() {
+        no_preempt preempt_guard;
+        std::unique_lock<std::mutex> guard(profile.lock);
+
+        __impl::stop_sampling();
+
+        profile.count = 0;
+        profile.dropped = 0;
+    }
+
+    size_t dropped() { return profile.dropped.load(); }
+
+    void profile_for(std::chrono::nanoseconds duration, std::ostream& out,
+                     unsigned frequency) {
+        clear();
+        start(frequency);
+
+        auto deadline = std::chrono::steady_clock::now() + duration;
+
+        // A gthread is parked while it waits, so that it neither keeps its
+        // kernel thread busy nor fills the profile with its own samples
+        if (__impl::scheduler::current_green_thread())
+            blocking([deadline] { std::this_thread::sleep_until(deadline); })
+                .get();
+
+        else
+            while (std::chrono::steady_clock::now() < deadline) {
+                if (__impl::scheduler::find_kernel_thread_context() &&
+                    executor::current().run_for(
+                        deadline - std::chrono::steady_clock::now()) != 0)
+                    continue;
+
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+
+        stop();
+        write_folded(out);
+    }
+
+}  // namespace gthread::profiler
\ No newline at end of file
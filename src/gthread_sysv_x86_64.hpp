@@ -18,9 +18,11 @@ namespace gthread::__impl {
             uint64_t rdi;
             uint64_t gp_regs[6];
 
-            // Include extra space as fxsave/fxrstore needs
-            // to be used on a 16-byte boundary
-            uint8_t fx_state[528];
+            // The SSE and x87 control words are the only floating point state
+            // a function has to preserve, every other register is saved by
+            // the caller if it needs it
+            uint32_t mxcsr;
+            uint16_t x87_control;
         };
 
     private:
@@ -38,44 +40,55 @@ namespace gthread::__impl {
                 "movq %r14, 48(%rdi) \n"
                 "movq %r15, 56(%rdi) \n"
 
-                "addq $79, %rdi \n"  // 64 + 15
-                "andq $~15, %rdi \n"
-                "fxsave (%rdi) \n"
+                "stmxcsr 64(%rdi) \n"
+                "fnstcw  68(%rdi) \n"
 
                 "movq  0(%rsi), %rsp \n"
-                "movq  8(%rsi), %rdi \n"
                 "movq 16(%rsi), %rbx \n"
                 "movq 24(%rsi), %rbp \n"
-                "movq 32(%rdi), %r12 \n"
-                "movq 40(%rdi), %r13 \n"
-                "movq 48(%rdi), %r14 \n"
-                "movq 56(%rdi), %r15 \n"
+                "movq 32(%rsi), %r12 \n"
+                "movq 40(%rsi), %r13 \n"
+                "movq 48(%rsi), %r14 \n"
+                "movq 56(%rsi), %r15 \n"
+
+                "ldmxcsr 64(%rsi) \n"
+                "fldcw   68(%rsi) \n"
 
-                "addq $79, %rsi \n"
-                "andq $~15, %rsi \n"
-                "fxrstor (%rsi) \n"
+                "movq  8(%rsi), %rdi \n"
 
                 "ret");
         }
+
+        // Stores the current control words, which a new gthread starts with
+        __attribute__((naked)) static void save_control_words(
+            platform_context*) {
+            asm("stmxcsr 64(%rdi) \n"
+                "fnstcw  68(%rdi) \n"
+                "ret");
+        }
 #else
         // swap_platform_context is not implemented on purpose
         static void swap_platform_contexts(platform_context* current,
                                            platform_context* next);
+
+        static void save_control_words(platform_context* context);
 #endif
 
         void platform_setup() override {
-            // A hack to get floating operations work on gthreads
-            swap_platform_contexts(&platform_ctx, &platform_ctx);
+            save_control_words(&platform_ctx);
 
+            // Leave room for the return address popped by ret so that the
+            // stack is 16 byte aligned minus 8 when entry starts, as if it was
+            // called
             platform_ctx.rsp = reinterpret_cast<uint64_t>(stack.get()) +
-                               static_cast<uint64_t>(stack_size);
+                               static_cast<uint64_t>(stack_size) - 16;
 
-            *reinterpret_cast<Function*>(platform_ctx.rsp) = function;
+            *reinterpret_cast<Function*>(platform_ctx.rsp) = entry;
 
-            platform_ctx.rdi = reinterpret_cast<uint64_t>(user_params);
+            platform_ctx.rdi = reinterpret_cast<uint64_t>(this);
         }
 
-        void platform_swap(std::shared_ptr<gthread> next) override {
+        void platform_swap(const std::shared_ptr<gthread>& next) override {
             auto next_thread = static_cast<sysv_x86_64_gthread*>(next.get());
             swap_platform_contexts(&platform_ctx, &next_thread->platform_ctx);
         }
@@ -74,12 +74,12 @@ namespace gthread::__impl {
                                static_cast<uint64_t>(stack_size);
             platform_ctx.rsp -= 32;
 
-            *reinterpret_cast<Function*>(platform_ctx.rsp) = function;
+            *reinterpret_cast<Function*>(platform_ctx.rsp) = entry;
 
-            platform_ctx.rcx = reinterpret_cast<uint64_t>(user_params);
+            platform_ctx.rcx = reinterpret_cast<uint64_t>(this);
         }
 
-        void platform_swap(std::shared_ptr<gthread> next) override {
+        void platform_swap(const std::shared_ptr<gthread>& next) override {
             auto next_thread = static_cast<win_x86_64_gthread*>(next.get());
             swap_platform_contexts(&platform_ctx, &next_thread->platform_ctx);
         }
@@ -67,11 +67,11 @@ namespace gthread::__impl {
             platform_ctx.esp -= 12;
 
             auto s = reinterpret_cast<uint32_t*>(platform_ctx.esp);
-            s[2] = reinterpret_cast<uint32_t>(user_params);
-            s[0] = reinterpret_cast<uint32_t>(function);
+            s[2] = reinterpret_cast<uint32_t>(this);
+            s[0] = reinterpret_cast<uint32_t>(entry);
         }
 
-        void platform_swap(std::shared_ptr<gthread> next) override {
+        void platform_swap(const std::shared_ptr<gthread>& next) override {
             auto next_thread = static_cast<x86_gthread*>(next.get());
             swap_platform_contexts(&platform_ctx, &next_thread->platform_ctx);
         }